@@ -1,4 +1,5 @@
 #include "Camera.h"
+#include <iostream>
 using namespace std;
 
 const Vec3 	 Camera::DEFAULT_C = Vec3(-50, 300, -20);
@@ -21,6 +22,29 @@ void Camera::lookAt(const Vec3 &P, int shiftH_, int shiftW_, double scale)
 	height *= scale; width *= scale;
 }
 
+// 设置裁剪窗口，窗口会被截断在屏幕范围之内；截断后为空的窗口无效，此时不裁剪、渲染整张照片
+void Camera::setCrop(int h, int w, int cropHeight_, int cropWidth_, double zoom_)
+{
+	cropH = max(h, 0); cropW = max(w, 0);
+	cropHeight = min(cropHeight_, height - cropH);
+	cropWidth = min(cropWidth_, width - cropW);
+	zoom = (zoom_ > EPSILON) ? zoom_ : 1.0;
+	if (cropHeight <= 0 || cropWidth <= 0)
+	{
+		cout << "Crop window (" << h << ", " << w << ") " << cropHeight_ << "x" << cropWidth_
+			 << " lies outside the " << height << "x" << width << " image, ignored" << endl;
+		resetCrop();
+	}
+}
+
+// 输出图像的像素(i, j)对应的屏幕坐标；放大时以像素中心对齐，zoom = 1时与原像素重合
+void Camera::pixelToScreen(double i, double j, double &h, double &w) const
+{
+	if (!cropped()) { h = i; w = j; return; }
+	h = cropH + (i + 0.5) / zoom - 0.5;
+	w = cropW + (j + 0.5) / zoom - 0.5;
+}
+
 // 获取射向屏幕中(h, w)像素的光线单位向量，不考虑景深。h, w可能不是整数（如超采样抗锯齿）
 Vec3 Camera::ray(double h, double w) const
 {
@@ -29,7 +53,7 @@ Vec3 Camera::ray(double h, double w) const
 }
 
 // 获取射向屏幕中(h, w)像素的光线起点和方向，考虑景深
-Camera::Ray Camera::rayAperture(double h, double w) const
+Camera::Ray Camera::rayAperture(double h, double w, Random &rng) const
 {
 	h += shiftH; w += shiftW;
 	// 光线初始方向、焦平面上物体位置
@@ -38,7 +62,7 @@ Camera::Ray Camera::rayAperture(double h, double w) const
 
 	// 在光圈上随机采样，获得随机偏移量detH, detW
 	double detH, detW;
-	do { detH = rand01() * 2.0 - 1.0; detW = rand01() * 2.0 - 1.0; } while (detH * detH + detW * detW >= 1.0);
+	do { detH = rng.next01() * 2.0 - 1.0; detW = rng.next01() * 2.0 - 1.0; } while (detH * detH + detW * detW >= 1.0);
 	Vec3 unitH = H.normalized(), unitW = W.normalized();
 
 	// 返回本次随机采样获得的光线：对光线起点加以随机扰动，但保证焦平面上物体清晰
@@ -2,6 +2,7 @@
 // 摄像机类Camera
 
 #include "Vec3.h"
+#include "Random.h"
 
 /**
 摄像机类Camera，负责发射光线、计算景深等
@@ -14,6 +15,9 @@ public:
 	Vec3 F, H, W;	    	// 镜头朝向、镜头方向标架(H, W)
 	int height, width;		// 照片的尺寸
 	int shiftH, shiftW; 	// 镜头在竖直、水平方向上的平移
+	int cropH, cropW;		// 裁剪窗口左上角的屏幕坐标
+	int cropHeight, cropWidth;	// 裁剪窗口的尺寸，为0时不裁剪、渲染整张照片
+	double zoom;			// 裁剪窗口的放大倍数，输出图像尺寸为窗口尺寸*zoom
 
 	double aperture;    // 光圈大小
 	double focalDist;   // 焦平面距离
@@ -34,12 +38,21 @@ public:
 		   double focalDist_ = DEFAULT_FOCAL_DIST,
 		   double nSample_ = DEFAULT_SAMPLE_NUM) 
 		   : C(C_), height(DEFAULT_HEIGHT), width(DEFAULT_WIDTH),
+		     cropH(0), cropW(0), cropHeight(0), cropWidth(0), zoom(1.0),
 		     aperture(aperture_), focalDist(focalDist_), nSample(nSample_) {}
 
 	// 方便地让相机对准场景中的某一个点
 	void lookAt(const Vec3 &P, int shiftH_ = 0, int shiftW_ = 0, double scale = 1.0);
+	// 只渲染屏幕上以(h, w)为左上角、大小为cropHeight_ * cropWidth_的窗口，并放大zoom倍输出（需在lookAt之后调用）
+	void setCrop(int h, int w, int cropHeight_, int cropWidth_, double zoom_ = 1.0);
+	void resetCrop() { cropH = cropW = cropHeight = cropWidth = 0; zoom = 1.0; }
+	bool cropped() const { return cropHeight > 0 && cropWidth > 0; }
+	// 输出图像的尺寸，及输出图像中像素(i, j)对应的屏幕坐标(h, w)
+	int imgHeight() const { return cropped() ? std::max(1, int(cropHeight * zoom)) : height; }
+	int imgWidth() const { return cropped() ? std::max(1, int(cropWidth * zoom)) : width; }
+	void pixelToScreen(double i, double j, double &h, double &w) const;
 	// 获取穿过屏幕某一个点(h, w)的光线
 	Vec3 ray(double h, double w) const;
 	// 用于景深，随机采样，获取穿过屏幕上(h, w)的光线，返回光线出发点、方向
-	Ray rayAperture(double h, double w) const;
+	Ray rayAperture(double h, double w, Random &rng) const;
 };
\ No newline at end of file
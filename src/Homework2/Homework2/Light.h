@@ -2,6 +2,7 @@
 // 光源类Light
 
 #include "Vec3.h"
+#include "Random.h"
 
 // 光源基类，所有光源必须实现纯虚函数phong的计算
 class Light
@@ -15,7 +16,7 @@ public:
 		: C(C_), color(color_) {}
 
 	// 在光源上随机获得一个采样点，适用于面光源/线光源
-	virtual Vec3 randomPoint() const = 0;
+	virtual Vec3 randomPoint(Random &rng) const = 0;
 
 	// Phong模型
 	virtual Color phong(
@@ -33,7 +34,7 @@ public:
 	PointLight(const Vec3 &C_, const Color &color_)
 		: Light(C_, color_) {}
 
-	virtual Vec3 randomPoint() const { return C; }
+	virtual Vec3 randomPoint(Random &) const { return C; }
 
 	virtual Color phong(
 		const Vec3 &N, 
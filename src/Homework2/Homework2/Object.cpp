@@ -1,6 +1,10 @@
 #include "Object.h"
 #include <opencv2/core/core.hpp>  
 #include <opencv2/highgui/highgui.hpp>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
 
 using namespace cv;
 using namespace std;
@@ -12,17 +16,61 @@ Texture::Texture(const string &fileName)
 {
 	Mat_<Vec3b> map = imread(fileName, IMREAD_COLOR);
 	rows = map.rows; cols = map.cols;
-	m_map.resize(rows); 
-	for (int i = 0; i < rows; i++) m_map[i].resize(cols);
-
+	m_levels.resize(1);
+	m_levels[0].resize(rows, cols);
 	for (int i = 0; i < rows; i++) for (int j = 0; j < cols; j++)
-		for (int co = 0; co < 3; co++)
-			m_map[i][j][co] = map(i, j)[2 - co] / 255.0;
+		m_levels[0].texels[m_levels[0].index(i, j)] = map(i, j)[2] | map(i, j)[1] << 8 | uint32_t(map(i, j)[0]) << 16;
+
+	// 逐级生成mipmap：每个纹素取上一级对应2 * 2个纹素的平均（奇数尺寸时边上的纹素重复取）
+	while (rows > 0 && cols > 0 && (m_levels.back().rows > 1 || m_levels.back().cols > 1))
+	{
+		Level level;
+		const Level &fine = m_levels.back();
+		level.resize((fine.rows + 1) / 2, (fine.cols + 1) / 2);
+		for (int i = 0; i < level.rows; i++) for (int j = 0; j < level.cols; j++)
+		{
+			int r[2] = { 2 * i, min(2 * i + 1, fine.rows - 1) }, c[2] = { 2 * j, min(2 * j + 1, fine.cols - 1) };
+			uint32_t texel = 0;
+			for (int co = 0; co < 3; co++)
+			{
+				uint32_t sum = 2;	// 四舍五入
+				for (int a = 0; a < 2; a++) for (int b = 0; b < 2; b++)
+					sum += fine.texels[fine.index(r[a], c[b])] >> (8 * co) & 0xFF;
+				texel |= (sum / 4) << (8 * co);
+			}
+			level.texels[level.index(i, j)] = texel;
+		}
+		m_levels.push_back(move(level));
+	}
+}
+
+// 同一文件名只加载一次；多线程同时加载时加锁
+Texture *Texture::load(const string &fileName)
+{
+	static mutex cacheMutex;
+	static map<string, unique_ptr<Texture>> cache;
+	lock_guard<mutex> lock(cacheMutex);
+	unique_ptr<Texture> &texture = cache[fileName];
+	if (!texture) texture.reset(new Texture(fileName));
+	return texture.get();
+}
+
+// 足迹覆盖约2^l个纹素时取第l级mipmap，非整数的l在相邻两级之间插值
+Color Texture::colorUV(double u, double v, double du, double dv) const
+{
+	double footprint = max(du * rows, dv * cols);
+	if (footprint <= 1) return bilinear(m_levels[0], u, v);
+	double level = min(log2(footprint), double(m_levels.size() - 1));
+	int l = int(level);
+	double t = level - l;
+	Color color = bilinear(m_levels[l], u, v);
+	return (t > 0) ? color * (1 - t) + bilinear(m_levels[l + 1], u, v) * t : color;
 }
 
 // 使用双线性插值算法，获取(u, v)处的纹理颜色，允许纹理重复铺满
-Color Texture::colorUV(double u, double v) const
+Color Texture::bilinear(const Level &level, double u, double v) const
 {
+	int rows = level.rows, cols = level.cols;
 	// 根据u, v计算图像中的像素坐标（非整数）
 	double row = (u - floor(u)) * rows, col = (v - floor(v)) * cols;
 
@@ -38,8 +86,12 @@ Color Texture::colorUV(double u, double v) const
 	c2 = (c2 < cols) ? c2 : 0;
 
 	// 双线性插值
-	return m_map[r1][c1] * detR * detC
-		 + m_map[r1][c2] * detR * (1 - detC)
-		 + m_map[r2][c1] * (1 - detR) * detC
-		 + m_map[r2][c2] * (1 - detR) * (1 - detC);
+	auto texel = [&level](int r, int c) {
+		uint32_t t = level.texels[level.index(r, c)];
+		return Color((t & 0xFF) / 255.0, (t >> 8 & 0xFF) / 255.0, (t >> 16 & 0xFF) / 255.0);
+	};
+	return texel(r1, c1) * detR * detC
+		 + texel(r1, c2) * detR * (1 - detC)
+		 + texel(r2, c1) * (1 - detR) * detC
+		 + texel(r2, c2) * (1 - detR) * (1 - detC);
 }
\ No newline at end of file
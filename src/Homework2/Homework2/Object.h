@@ -6,20 +6,40 @@
 #include <string>
 #include <vector>
 #include <cstdlib>
+#include <cstdint>
 #include <iostream>
 
 /**
-纹理类Texture，用于实现纹理贴图
+纹理类Texture，用于实现纹理贴图：
+纹素按8位RGB打包为32位整数，以4 * 4的图块存放，一个图块恰为一个缓存行，双线性插值的4个纹素通常位于同一图块中；
+另预先生成逐级缩小一半的mipmap，按光线在碰撞点处的足迹选择层级，远处的纹理不再走样。
+同一文件的纹理应通过Texture::load取得，整个进程只解码、存放一份
 */
 struct Texture
 {
 public:
 	Texture(const std::string &fileName);
-	Color colorUV(double u, double v) const;	// 在UV坐标系下，利用双线性插值算法获取(u, v)处的颜色值
+	// 从纹理缓存中取文件fileName的纹理，首次取时才解码；纹理在进程退出前一直有效
+	static Texture *load(const std::string &fileName);
+	// 在UV坐标系下，利用双线性插值算法获取(u, v)处的颜色值；du、dv为光线足迹在UV坐标下的宽度，
+	// 足迹超过一个纹素时在相邻两级mipmap之间再做插值（三线性插值），为0时直接取原图
+	Color colorUV(double u, double v, double du = 0, double dv = 0) const;
 	int rows, cols;
 
 private:
-	std::vector<std::vector<Vec3>> m_map;
+	// 一级mipmap
+	struct Level
+	{
+		int rows, cols, tilesW;	// 尺寸、每行的图块数
+		std::vector<uint32_t> texels;
+		size_t index(int r, int c) const { return (size_t(r >> 2) * tilesW + (c >> 2)) * 16 + (r & 3) * 4 + (c & 3); }
+		void resize(int rows_, int cols_) {
+			rows = rows_; cols = cols_; tilesW = (cols + 3) / 4;
+			texels.assign(size_t((rows + 3) / 4) * tilesW * 16, 0);
+		}
+	};
+	Color bilinear(const Level &level, double u, double v) const;
+	std::vector<Level> m_levels;	// 第0级为原图
 };
 
 /**
@@ -63,9 +83,9 @@ public:
 	}
 
 	// 判断物体与光线相交的情况：如果无交点/距离超过maxDist则返回MISS。
-	// 如有碰撞，将碰撞点信息（如P、N等）存入备用
+	// 如有碰撞，将碰撞点信息（如P、N等）存入备用；cone为光线每前进单位距离足迹宽度的增量，用于选择纹理的mipmap层级
 	virtual Intersection intersect(const Vec3 &ori, const Vec3 &dir, double &maxDist,
-				 /*output*/ Vec3 *P = NULL, Vec3 *N = NULL, Color *objectColor = NULL) const = 0;
+				 /*output*/ Vec3 *P = NULL, Vec3 *N = NULL, Color *objectColor = NULL, double cone = 0) const = 0;
 };
 
 /**
@@ -77,19 +97,24 @@ struct HitPoint
 {
 	Vec3 P, N;		// 碰撞点的位置、法向量
 	Object *object;	// 该碰撞点位于的物体
+	int view;		// 碰撞点所属的视图（相机）编号
 	int row, col; 	// 碰撞点对应的屏幕坐标(row, col)
 	Color weight;	// 计算此碰撞点处的色光权值，乘以累计的光通量，乘以一个系数后为最终颜色值
 	Color phi;		// 本碰撞点处的累计光通量
-	double radius2, maxRadius2;	// 本碰撞点的最大半径、本子树下的最大半径
+	double radius2;	// 本碰撞点的最大半径（平方）
 	double nAccum, nNew;	// 对应于论文中的N、M：之前的累计光子数、本轮新增光子数
+	double iter0;	// 开始累计光子时已完成的（等效）迭代轮数，估算辉度时只计入此后的轮数
+	double iter1;	// 已收敛而冻结时已完成的迭代轮数，此后不再累计光子；未冻结时为负
 
-	HitPoint() {}
-	HitPoint(int row_, int col_, const Color &weight_)
-		: row(row_), col(col_), weight(weight_),
-		  nAccum(0), nNew(0), phi(Color(0, 0, 0)) {}
+	HitPoint() : object(NULL), view(0), row(0), col(0), radius2(0), nAccum(0), nNew(0), iter0(0), iter1(-1) {}
+	HitPoint(int row_, int col_, const Color &weight_, int view_ = 0)
+		: view(view_), row(row_), col(col_), weight(weight_),
+		  nAccum(0), nNew(0), iter0(0), iter1(-1), phi(Color(0, 0, 0)) {}
+
+	bool frozen() const { return iter1 >= 0; }
 
 	void update(double a) {	// a为论文中的α值
-		if (nAccum <= 0 || nNew <= 0) return;	
+		if (nNew <= 0) return;	// 首次收到光子时N为0，半径按k = α缩小
 		double k = (nAccum + a * nNew) / (nAccum + nNew);	// 半径衰减速率
 		radius2 *= k; phi *= k;		// 半径缩小、光通量与面积成比例地缩小
 		nAccum += a * nNew; nNew = 0;	// 更新累计光子数、清零新增光子数
@@ -0,0 +1,45 @@
+#include "Random.h"
+#include <cmath>
+using namespace std;
+
+// 以种子初始化各维的基数与每一位的随机数字置换
+QMCSequence::QMCSequence(uint64_t seed)
+{
+	static const int PRIMES[DIMS] = { 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37 };
+	for (int d = 0; d < DIMS; d++)
+	{
+		int b = m_base[d] = PRIMES[d];
+		m_nDigit[d] = int(ceil(53 / log2(double(b))));
+		m_perm[d].resize(m_nDigit[d] * b);
+		for (int k = 0; k < m_nDigit[d]; k++)
+		{
+			// 用Philox生成Fisher-Yates洗牌所需的随机数，每一(维, 位)使用独立的样本编号
+			Random rng(seed, Random::SCRAMBLE, uint64_t(d) << 32 | k);
+			uint16_t *perm = &m_perm[d][k * b];
+			for (int i = 0; i < b; i++) perm[i] = i;
+			for (int i = b - 1; i > 0; i--) swap(perm[i], perm[int(rng.next01() * (i + 1))]);
+		}
+
+		// 从第k位起全部为数字0时，其余各位的贡献之和
+		m_tail[d].assign(m_nDigit[d] + 1, 0.0);
+		double unit = pow(1.0 / b, m_nDigit[d]);
+		for (int k = m_nDigit[d] - 1; k >= 0; k--, unit *= b)
+			m_tail[d][k] = m_tail[d][k + 1] + m_perm[d][k * b] * unit;
+	}
+}
+
+// 加扰的根式反演：从低位到高位取出index的各位数字，置换后镜像到小数点之后
+double QMCSequence::sample(int dim, uint64_t index) const
+{
+	int b = m_base[dim];
+	const uint16_t *perm = m_perm[dim].data();
+	double unit = 1.0 / b, ret = 0.0;
+	int k = 0;
+	for (; index > 0 && k < m_nDigit[dim]; k++, unit /= b)
+	{
+		ret += perm[k * b + index % b] * unit;
+		index /= b;
+	}
+	ret += m_tail[dim][k];
+	return min(ret, 1.0 - 1e-16);
+}
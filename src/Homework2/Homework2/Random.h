@@ -0,0 +1,98 @@
+#pragma once
+// 基于计数器的随机数发生器Random、加扰Halton低差异序列QMCSequence
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+/**
+加扰的Halton低差异序列QMCSequence，用于拟蒙特卡洛（QMC）光子发射：
+第d维以第d个素数为基数对样本编号做根式反演，每一位数字再经过由种子决定的随机置换（随机数字加扰），
+以消除高维Halton序列各维之间的相关性。序列按光子的全局编号取样，跨越各轮PPM迭代连续，分层性质逐轮保持
+*/
+class QMCSequence
+{
+public:
+	static const int BOUNCES = 4;	// 前BOUNCES个随机数段（发射 + 前3次弹射）使用低差异序列
+	static const int DIMS_PER_BOUNCE = 3;	// 每段的前3维：发射方向2维；弹射时轮盘赌1维 + 余弦采样2维
+	static const int DIMS = BOUNCES * DIMS_PER_BOUNCE;
+
+	QMCSequence(uint64_t seed);
+	// 序列中第index个点的第dim维坐标，位于[0, 1)内
+	double sample(int dim, uint64_t index) const;
+
+private:
+	int m_base[DIMS];	// 各维的基数（素数）
+	int m_nDigit[DIMS];	// 各维参与加扰的位数，超出部分的贡献小于双精度
+	std::vector<uint16_t> m_perm[DIMS];	// 各维每一位的数字置换表
+	std::vector<double> m_tail[DIMS];	// 样本编号的各位用完之后，剩余各位（数字0经置换后）的贡献之和
+};
+
+/**
+基于计数器的随机数发生器Random，采用Philox4x32-10算法：
+每个随机数都是(种子, 流编号, 样本编号, 弹射次数, 维度)的纯函数，不依赖任何共享状态。
+因此多线程下无需加锁、各线程之间也不相关，同一种子在任意线程数下都能得到完全相同的图像。
+用法：每个光子（或像素）以其全局编号构造一个Random，每次弹射前调用bounce()切换到对应的维度段。
+若给定了QMCSequence，则前几段的前几维改由低差异序列提供，其余维度仍使用Philox；
+若给定了原始样本空间（primary sample space）中的向量u，则第b段的第k维取u[b * PSS_DIMS_PER_BOUNCE + k]，
+用于马尔可夫链光子追踪中对整条光子路径做变异
+*/
+class Random
+{
+public:
+	// 不同用途的随机数流，保证光线追踪与光子发射使用的随机数互不重叠
+	// PATH为马尔可夫链光子追踪中超出原始样本空间的维度
+	enum Stream { CAMERA = 0, PHOTON = 1, SCRAMBLE = 2, MUTATE = 3, PATH = 4 };
+	static const int PSS_DIMS_PER_BOUNCE = 4;	// 原始样本空间中每个随机数段的维数
+
+	Random(uint64_t seed, uint32_t stream, uint64_t index, const QMCSequence *qmc = NULL)
+		: m_qmc(qmc), m_pss(NULL), m_pssSize(0), m_index(index), m_bounce(0), m_dim(0), m_block(0), m_left(0) {
+		m_key[0] = uint32_t(seed); m_key[1] = uint32_t(seed >> 32);
+		m_ctr[0] = uint32_t(index); m_ctr[1] = uint32_t(index >> 32);
+		m_ctr[2] = 0; m_ctr[3] = stream;
+	}
+
+	// 改从原始样本空间向量u（长度为size）中取随机数
+	void usePSS(const double *u, int size) { m_pss = u; m_pssSize = size; }
+
+	// 切换到第b次弹射的随机数段，每段内的随机数按顺序取用
+	void bounce(int b) { m_ctr[2] = uint32_t(b) << 16; m_bounce = b; m_dim = 0; m_block = 0; m_left = 0; }
+
+	// 获取一个[0, 1)内均匀分布的随机数（53位精度）
+	double next01() {
+		if (m_pss && m_dim < PSS_DIMS_PER_BOUNCE && m_bounce * PSS_DIMS_PER_BOUNCE + m_dim < m_pssSize)
+			return m_pss[m_bounce * PSS_DIMS_PER_BOUNCE + m_dim++];
+		if (m_qmc && m_bounce < QMCSequence::BOUNCES && m_dim < QMCSequence::DIMS_PER_BOUNCE)
+			return m_qmc->sample(m_bounce * QMCSequence::DIMS_PER_BOUNCE + m_dim++, m_index);
+		if (m_left == 0) { generate(); m_left = 4; }
+		uint32_t a = m_buffer[--m_left] >> 5, b = m_buffer[--m_left] >> 6;
+		return (a * 67108864.0 + b) / 9007199254740992.0;
+	}
+
+private:
+	// 以当前计数器生成4个32位随机数
+	void generate() {
+		uint32_t ctr[4] = { m_ctr[0], m_ctr[1], m_ctr[2] | m_block++, m_ctr[3] };
+		uint32_t key[2] = { m_key[0], m_key[1] };
+		for (int round = 0; round < 10; round++)
+		{
+			uint64_t p0 = uint64_t(0xD2511F53) * ctr[0];
+			uint64_t p1 = uint64_t(0xCD9E8D57) * ctr[2];
+			uint32_t c0 = uint32_t(p1 >> 32) ^ ctr[1] ^ key[0], c1 = uint32_t(p1);
+			uint32_t c2 = uint32_t(p0 >> 32) ^ ctr[3] ^ key[1], c3 = uint32_t(p0);
+			ctr[0] = c0; ctr[1] = c1; ctr[2] = c2; ctr[3] = c3;
+			key[0] += 0x9E3779B9; key[1] += 0xBB67AE85;
+		}
+		for (int i = 0; i < 4; i++) m_buffer[i] = ctr[i];
+	}
+
+	const QMCSequence *m_qmc;	// 低差异序列，为NULL时全部使用Philox
+	const double *m_pss;		// 原始样本空间向量，为NULL时不使用
+	int m_pssSize;
+	uint64_t m_index;	// 样本编号，即低差异序列中的下标
+	int m_bounce, m_dim;	// 当前的随机数段、段内已取用的维数
+	uint32_t m_key[2], m_ctr[4];
+	uint32_t m_buffer[4];
+	uint32_t m_block;	// 本段内已生成的块数
+	int m_left;			// m_buffer中剩余可用的32位随机数个数
+};
@@ -1,4 +1,5 @@
 #include "Vec3.h"
+#include "Random.h"
 using namespace std;
 
 Vec3 Vec3::normalized() const
@@ -51,23 +52,21 @@ Vec3 Vec3::normal() const
 }
 
 // 得到一个按照角度随机分布于单位球内的单位向量
-Vec3 Vec3::random()
+// 用2个随机数直接反演（z均匀分布于[-1, 1]，方位角均匀分布），不做拒绝采样，以便使用低差异序列
+Vec3 Vec3::random(Random &rng)
 {
-	double x, y, z;
-	do {
-		x = 2 * rand01() - 1;
-		y = 2 * rand01() - 1;
-		z = 2 * rand01() - 1;
-	} while ( x * x + y * y + z * z > 1 || x * x + y * y + z * z < EPSILON );
-	return Vec3( x, y, z ).normalized(); 
+	double z = 1 - 2 * rng.next01();
+	double phi = 2 * PI * rng.next01();
+	double r = sqrt(max(1 - z * z, 0.0));
+	return Vec3(r * cos(phi), r * sin(phi), z);
 }
 
 // 得到一个按照余弦值加权后随机分布于单位球内的单位向量
-Vec3 Vec3::randomCosine(const Vec3 &N)
+Vec3 Vec3::randomCosine(const Vec3 &N, Random &rng)
 {
 	// 与竖直方向的夹角theta按照余弦值加权
-	double theta = acos(sqrt(rand01()));
-	double phi = 2 * PI * rand01();
+	double theta = acos(sqrt(rng.next01()));
+	double phi = 2 * PI * rng.next01();
 	Vec3 ret = N.rotated(N.normal(), theta);
     return ret.rotated(N, phi).normalized();
 }
\ No newline at end of file
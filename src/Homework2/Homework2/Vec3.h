@@ -8,8 +8,8 @@
 
 #define EPSILON 1e-6	// 考虑浮点精度误差
 #define PI 3.1415926535897932384626	
-#define rand01() (rand() / double(RAND_MAX))	// 线程不安全，需每次重新srand
 struct Vec3;
+class Random;
 typedef Vec3 Color;
 
 /**
@@ -39,8 +39,8 @@ struct Vec3
 	Vec3 normal() const;
 
 	// 得到一个按角度均匀分布/按余弦值均匀分布于单位球的随机单位向量
-	static Vec3 random();
-	static Vec3 randomCosine(const Vec3 &N);
+	static Vec3 random(Random &rng);
+	static Vec3 randomCosine(const Vec3 &N, Random &rng);
 
 	// 运算符重载、点乘、叉乘等
 	Vec3 operator - () const { return Vec3( -x, -y, -z ); }
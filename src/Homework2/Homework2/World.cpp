@@ -8,11 +8,12 @@ World::World() : nObject(0), nLight(0)
 {
 	renderer = new Renderer;
 	camera = new Camera;
+	cameras.push_back(camera);
 }
 
 World::~World() 
 {
-	delete camera;
+	for (Camera *view : cameras) delete view;
 	for (int i = 0; i < nObject; i++) delete objects[i];
 	for (int i = 0; i < nLight; i++) delete lights[i];
 }
@@ -23,4 +24,5 @@ void World::render() {
 }
 void World::saveImg(const std::string &fileName) { 
 	renderer->saveImg(fileName); 
+	renderer->flushImages();	// 渲染之外的调用方随后可能直接退出，等待写盘完成
 }
\ No newline at end of file
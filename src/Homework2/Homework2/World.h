@@ -17,7 +17,8 @@ class World
 {
 public:
 	Renderer *renderer;	// 渲染引擎
-	Camera *camera;	// 相机
+	Camera *camera;	// 主相机，即cameras[0]
+	std::vector<Camera*> cameras;	// 所有相机（视图），共享同一轮光子发射
 	int nObject, nLight;	// 物体数量、光源数量
 	std::vector<Object*> objects;	// 物体数组
 	std::vector<Light*> lights;		// 光源数组
@@ -28,6 +29,7 @@ public:
 	~World();
 	void add(Object *object) { objects.push_back(object); }	// 添加物体
 	void add(Light *light) { lights.push_back(light); }	// 添加光源
+	void add(Camera *camera_) { cameras.push_back(camera_); }	// 添加额外的视图（如立体像对的另一只眼）
 	void render();	// 渲染
-	void saveImg(const std::string &fileName);	// 保存图片，支持各种格式
+	void saveImg(const std::string &fileName);	// 保存图片，支持各种格式（.pfm为HDR）；多视图时第v个视图保存为name_v.ext，返回时已写盘
 };
\ No newline at end of file
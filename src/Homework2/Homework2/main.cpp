@@ -6,6 +6,7 @@
 #include "renderer/Renderer.h"
 #include <omp.h>
 #include <cmath>
+#include <csignal>
 #include <iostream>
 #include <opencv2/core/core.hpp>  
 #include <opencv2/highgui/highgui.hpp>
@@ -14,6 +15,10 @@ using namespace cv;
 using namespace std;
 
 Mat img(800, 600, CV_8UC3);
+World *world = NULL;
+
+// Ctrl+C：本轮结束后停止渲染，保留当前最好的图像
+void onInterrupt(int) { if (world) world->renderer->requestStop(); }
 
 Vector3d* createBezier(Matrix3d *change) {
 	Vector3d* ret = new Vector3d[16];
@@ -117,18 +122,19 @@ Vec3 *createLink()
 	return pos;
 }
 
-int main()
+int main(int argc, char *argv[])
 {
 	// world
-	World *world = new World;
+	world = new World;
+	signal(SIGINT, onInterrupt);
 	world->bgColor = (Vec3(0.25, 0.25, 0.25));
 
 	// Textures
-	Texture *marble = new Texture("marble.bmp");
-	Texture *wood = new Texture("wood2.jpg");
-	Texture *blue = new Texture("marble6.jpg");
-	Texture *leaf = new Texture("leaf3.jpg");
-	Texture *paper = new Texture("girls2.jpg");
+	Texture *marble = Texture::load("marble.bmp");
+	Texture *wood = Texture::load("wood2.jpg");
+	Texture *blue = Texture::load("marble6.jpg");
+	Texture *leaf = Texture::load("leaf3.jpg");
+	Texture *paper = Texture::load("girls2.jpg");
 
 	// Walls
 	Sphere *frontWall = new Sphere(Vec3(0, 0, 1e5 + 2), 1e5, "front");
@@ -255,17 +261,32 @@ int main()
 	// look at
 	double s = 1 / 0.6;
 	world->camera->lookAt(Vec3(0, 0, -200), 200, 160, s);
+	// 只检查局部细节（如明珠下方地板上的焦散）时，可只渲染一个窗口：
+	// world->camera->setCrop(行, 列, 窗口高, 窗口宽, 放大倍数);
 
-	// Render
-	world->render();
+	// 多进程渲染：Homework2 --coordinator 共享文件 工作进程数；Homework2 --worker 共享文件 工作进程编号
+	string mode = (argc >= 4) ? argv[1] : "";
+	if (mode == "--worker")
+	{
+		world->renderer->renderWorker(world, argv[2], atoi(argv[3]));
+		return 0;
+	}
+	if (mode == "--coordinator")
+		world->renderer->renderCoordinator(world, argv[2], atoi(argv[3]));
+	else
+	{
+		// Render
+		// 需要快速预览时可先以1/8分辨率渲染（preview.jpg），再逐级细化到全分辨率，如：world->renderer->setPreview(3);
+		// 渲染农场上可设置预算，如：world->renderer->setBudget(3600, 0.02);
+		// 超出物理内存的超大图像可开启超大图像模式，如：world->renderer->setOutOfCore("D:/swap");
+		// 长时间渲染可定期写检查点，中断后重新运行即从检查点继续，如：world->renderer->setCheckpoint("render.ckpt", 600);
+		// 实时查看渲染进度可开启预览通道，由查看程序映射同一文件读取，如：world->renderer->setPreviewChannel("/dev/shm/ppm_preview");
+		world->render();
+	}
 	world->saveImg("test.jpg");
-
-	Mat_<Vec3b> img = cv::imread("update.jpg", IMREAD_COLOR);
-	for (int i = 0; i < img.rows; i++)
-		for (int j = 0; j < img.cols; j++)
-			img(i, j) *= 10;
-
-	cv::imwrite("update_light.jpg", img);
+	world->saveImg("test.pfm");	// 完整动态范围的HDR图像
+	world->renderer->saveImg("update_light.jpg", 10);	// 提亮10倍，在截断之前完成，亮部层次不受损失
+	world->renderer->flushImages();
 
 	system("pause");
 	return 0;
@@ -253,7 +253,7 @@ struct Node
 using namespace std;
 ofstream ofs("debug.txt");
 
-Intersection Double3Bezier::intersect(const Vec3 &ori, const Vec3 &dir, double &maxDist,/*output*/ Vec3 *P_, Vec3 *N, Vec3 *objectColor) const
+Intersection Double3Bezier::intersect(const Vec3 &ori, const Vec3 &dir, double &maxDist,/*output*/ Vec3 *P_, Vec3 *N, Vec3 *objectColor, double cone) const
 {
 	// eps: 最终队列中剩余的小曲面包围盒尺寸
 	const double eps = 1e-2;
@@ -346,7 +346,10 @@ Intersection Double3Bezier::intersect(const Vec3 &ori, const Vec3 &dir, double &
 		double u = bestPatch.kU * bestU + bestPatch.bU;
 		double v = bestPatch.kV * bestV + bestPatch.bV;
 	//	ofs << "u = " << u << ", v = " << v << endl;
-		*objectColor *= texture->colorUV(u, v);
+		// 足迹宽度除以曲面对参数的导数的模，即为足迹在参数空间中的宽度
+		double width = cone * maxDist;
+		*objectColor *= texture->colorUV(u, v, width * fabs(bestPatch.kU) / max(derivU.norm(), EPSILON),
+			width * fabs(bestPatch.kV) / max(derivV.norm(), EPSILON));
 	}
 	return OUTSIDE;
 }
@@ -25,7 +25,7 @@ public:
 	}
 
 	virtual Intersection intersect(const Vec3 &ori, const Vec3 &dir, double &maxDist,
-		/*output*/ Vec3 *P = NULL, Vec3 *N = NULL, Vec3 *objectColor = NULL) const;
+		/*output*/ Vec3 *P = NULL, Vec3 *N = NULL, Vec3 *objectColor = NULL, double cone = 0) const;
 	void saveAsObj(EVec3d *P_);
 
 private:
@@ -5,7 +5,7 @@ const Vec3 Plane::DEFAULT_TEXU = Vec3(400, 0, 0);
 const Vec3 Plane::DEFAULT_TEXV = Vec3(0, 0, 300);
 
 // 调用此函数前需保证N和dir已经单位化
-Intersection Plane::intersect(const Vec3 &ori, const Vec3 &dir, double &maxDist,/*output*/ Vec3 *P, Vec3 *N_, Color *objectColor) const
+Intersection Plane::intersect(const Vec3 &ori, const Vec3 &dir, double &maxDist,/*output*/ Vec3 *P, Vec3 *N_, Color *objectColor, double cone) const
 {
 	double bsinA = dot(C - ori, N);
 	double sinB = dot(dir, N);
@@ -17,17 +17,17 @@ Intersection Plane::intersect(const Vec3 &ori, const Vec3 &dir, double &maxDist,
 		maxDist = a;
 		if (P) *P = ori + dir * maxDist;
 		if (N_) *N_ = N;
-		if (objectColor) *objectColor = color * (texture == NULL ? Color(1, 1, 1) : this->texColor(*P));
+		if (objectColor) *objectColor = color * (texture == NULL ? Color(1, 1, 1) : this->texColor(*P, cone * maxDist));
 		return OUTSIDE;
 	}
 	return MISS;
 }
 
 // 这里实现的是适合于地板贴图的一个特例
-Color Plane::texColor(const Vec3 &P) const
+Color Plane::texColor(const Vec3 &P, double width) const
 {
 	if (texture == NULL) return Vec3(1, 1, 1);
 	double v = 0.5 + (P.x - C.x) / texU.length();
 	double u = 0.5 + (P.z - C.z) / texV.length();
-	return texture->colorUV(u, v);
+	return texture->colorUV(u, v, width / texV.length(), width / texU.length());
 }
\ No newline at end of file
@@ -18,6 +18,6 @@ public:
 			texV = DEFAULT_TEXV;
 		}
 	virtual Intersection intersect(const Vec3 &ori, const Vec3 &dir, double &maxDist,
-				/*output*/ Vec3 *P = NULL, Vec3 *N_ = NULL, Color *objectColor = NULL) const;
-	Color texColor(const Vec3 &P) const;
+				/*output*/ Vec3 *P = NULL, Vec3 *N_ = NULL, Color *objectColor = NULL, double cone = 0) const;
+	Color texColor(const Vec3 &P, double width = 0) const;
 };
\ No newline at end of file
@@ -5,7 +5,7 @@ const Vec3 Sphere::DEFAULT_TEXU = Vec3(1, 0, -3);
 const Vec3 Sphere::DEFAULT_TEXV = Vec3(0, 1, 0);
 
 // 调用此函数前，必须保证dir是单位向量
-Intersection Sphere::intersect(const Vec3 &ori, const Vec3 &dir, double &maxDist, Vec3 *P, Vec3 *N, Color *objectColor) const
+Intersection Sphere::intersect(const Vec3 &ori, const Vec3 &dir, double &maxDist, Vec3 *P, Vec3 *N, Color *objectColor, double cone) const
 {
 	Vec3 L = C - ori;
 
@@ -21,12 +21,12 @@ Intersection Sphere::intersect(const Vec3 &ori, const Vec3 &dir, double &maxDist
 	maxDist = (dist1 > EPSILON) ? dist1 : dist2;
 	if (P) *P = ori + dir * maxDist;
 	if (N) *N = (*P - C).normalized();
-	if (objectColor) *objectColor = color * (texture == NULL ? Color(1, 1, 1) : this->texColor(*P));
+	if (objectColor) *objectColor = color * (texture == NULL ? Color(1, 1, 1) : this->texColor(*P, cone * maxDist));
 	return (dist1 > EPSILON) ? OUTSIDE : INSIDE;
 }
 
-// 将球面极坐标对应到纹理空间的UV坐标
-Color Sphere::texColor(const Vec3 &P) const
+// 将球面极坐标对应到纹理空间的UV坐标；u沿经线（长πR），v沿纬线（长2πR·sinθ）
+Color Sphere::texColor(const Vec3 &P, double width) const
 {
 	if (texture == NULL) return Color(1, 1, 1);
 	Vec3 N = (P - C).normalized();
@@ -35,5 +35,5 @@ Color Sphere::texColor(const Vec3 &P) const
 	double phi = acos(min(max(dot(N, texU) / sin(theta), -1.0), 1.0));
 	double u = theta / PI, v = phi / (2 * PI);
 	v = (dot(N, cross(texU, texV)) < 0) ? (1 - v) : v;
-	return texture->colorUV(u, v);
+	return texture->colorUV(u, v, width / (PI * R), width / (2 * PI * R * max(sin(theta), EPSILON)));
 }	
\ No newline at end of file
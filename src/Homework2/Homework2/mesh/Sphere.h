@@ -19,7 +19,7 @@ public:
 			texV = DEFAULT_TEXV.normalized();
 		}
 	virtual Intersection intersect(const Vec3 &ori, const Vec3 &dir, double &maxDist,
-				/*output*/ Vec3 *P = NULL, Vec3 *N = NULL, Color *objectColor = NULL) const;
-	// 计算P点处的纹理颜色
-	Color texColor(const Vec3 &P) const;
+				/*output*/ Vec3 *P = NULL, Vec3 *N = NULL, Color *objectColor = NULL, double cone = 0) const;
+	// 计算P点处的纹理颜色，width为光线在P点处足迹的宽度
+	Color texColor(const Vec3 &P, double width = 0) const;
 };
\ No newline at end of file
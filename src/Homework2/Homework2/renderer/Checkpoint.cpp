@@ -0,0 +1,185 @@
+#include "Renderer.h"
+#include "../World.h"
+#include "../Camera.h"
+#include <cstring>
+#include <cstdint>
+#include <iostream>
+#include <unordered_map>
+using namespace std;
+
+namespace
+{
+	// 检查点文件的布局：[Header][CheckpointView × nView][HitPoint × nHitpoint][物体编号 × nHitpoint]
+	// [HitPoint × nBgHitpoint][物体编号 × nBgHitpoint]。HitPoint按内存布局原样存放，只能由同一版本的程序载入；
+	// 其中的物体指针无意义，载入时按物体编号恢复
+	const uint32_t CHECKPOINT_MAGIC = 0x50434D50;	// "PMCP"
+	const uint32_t CHECKPOINT_VERSION = 2;
+	struct CheckpointView	// 决定碰撞点的相机参数：位姿、镜头、裁剪窗口与输出尺寸
+	{
+		int32_t height, width;		// 输出图像的尺寸
+		int32_t shiftH, shiftW, cropH, cropW, cropHeight, cropWidth;
+		double C[3], F[3], H[3], W[3];
+		double zoom, aperture, focalDist;
+	};
+	struct CheckpointHeader
+	{
+		uint32_t magic, version;
+		uint32_t hitpointSize;		// sizeof(HitPoint)，检查布局是否一致
+		int32_t nObject, nView;
+		int32_t nHitpoint, nBgHitpoint;
+		int32_t iteration;			// 全分辨率下已完成的迭代轮数
+		uint64_t seed, nEmitted;	// 随机数种子、已发射的光子总数（即光子随机数的位置）
+		double nIter;				// 累计的（等效）迭代轮数
+		double radius, initRadius, alpha;
+		double nUniform, nUniformVisible, fluxScale;
+		double photonRate, iterOverhead;	// 按目标时间调整每轮光子数时测得的吞吐量与固定开销
+	};
+
+	// 按字节比较，填写前先清零，使结构体中的填充字节也确定
+	CheckpointView viewOf(const Camera &camera)
+	{
+		CheckpointView view;
+		memset(&view, 0, sizeof(view));
+		view.height = camera.imgHeight(); view.width = camera.imgWidth();
+		view.shiftH = camera.shiftH; view.shiftW = camera.shiftW;
+		view.cropH = camera.cropH; view.cropW = camera.cropW;
+		view.cropHeight = camera.cropHeight; view.cropWidth = camera.cropWidth;
+		for (int k = 0; k < 3; k++)
+			view.C[k] = camera.C[k], view.F[k] = camera.F[k], view.H[k] = camera.H[k], view.W[k] = camera.W[k];
+		view.zoom = camera.zoom; view.aperture = camera.aperture; view.focalDist = camera.focalDist;
+		return view;
+	}
+
+	size_t checkpointSize(const CheckpointHeader &header)
+	{
+		return sizeof(CheckpointHeader) + sizeof(CheckpointView) * header.nView
+			+ (sizeof(HitPoint) + sizeof(int32_t)) * (size_t(header.nHitpoint) + header.nBgHitpoint);
+	}
+
+	// 写入n个碰撞点及其物体编号，返回写入之后的位置
+	char *writeHitpoints(char *p, const HitPoint *hitpoints, int n, const unordered_map<const Object*, int> &objectIndex)
+	{
+		memcpy(p, hitpoints, sizeof(HitPoint) * n);
+		p += sizeof(HitPoint) * n;
+		for (int i = 0; i < n; i++, p += sizeof(int32_t))
+		{
+			auto it = objectIndex.find(hitpoints[i].object);
+			int32_t index = (it == objectIndex.end()) ? -1 : it->second;
+			memcpy(p, &index, sizeof(int32_t));
+		}
+		return p;
+	}
+
+	const char *readHitpoints(const char *p, HitPoint *hitpoints, int n, const vector<Object*> &objects)
+	{
+		memcpy(hitpoints, p, sizeof(HitPoint) * n);
+		p += sizeof(HitPoint) * n;
+		for (int i = 0; i < n; i++, p += sizeof(int32_t))
+		{
+			int32_t index;
+			memcpy(&index, p, sizeof(int32_t));
+			hitpoints[i].object = (index >= 0) ? objects[index] : NULL;
+		}
+		return p;
+	}
+}
+
+// 碰撞点此后只在下一轮的updateKDMap中改动，而它要先等待finishOutput，因此后台线程可以直接读取碰撞点，无需拷贝
+void Renderer::saveCheckpoint(double nIter, int iteration)
+{
+	if (m_checkpoint.valid())
+	{
+		if (m_checkpoint.wait_for(chrono::seconds(0)) != future_status::ready) return;	// 上一次仍在写入
+		m_checkpoint.get();
+	}
+	m_lastCheckpoint = chrono::steady_clock::now();
+
+	CheckpointHeader header;
+	header.magic = CHECKPOINT_MAGIC; header.version = CHECKPOINT_VERSION;
+	header.hitpointSize = sizeof(HitPoint);
+	header.nObject = m_world->objects.size(); header.nView = m_photos.size();
+	header.nHitpoint = m_hitpoints.size(); header.nBgHitpoint = m_bgHitpoints.size();
+	header.iteration = iteration;
+	header.seed = m_seed; header.nEmitted = m_nEmitted;
+	header.nIter = nIter;
+	header.radius = m_radius; header.initRadius = INIT_RADIUS; header.alpha = ALPHA;
+	header.nUniform = m_nUniform; header.nUniformVisible = m_nUniformVisible; header.fluxScale = m_fluxScale;
+	header.photonRate = m_photonRate; header.iterOverhead = m_iterOverhead;
+
+	m_checkpoint = async(launch::async, [this, header]() {
+		unordered_map<const Object*, int> objectIndex;
+		for (int k = 0; k < header.nObject; k++) objectIndex[m_world->objects[k]] = k;
+
+		// 先写临时文件并确认落盘，再原子地替换旧的检查点，任何时刻被中断都至少留下一份完整的检查点
+		string tmpPath = m_checkpointPath + ".tmp";
+		MappedFile file;
+		if (!file.create(tmpPath, checkpointSize(header)))
+		{
+			cout << "Cannot create checkpoint " << tmpPath << endl;
+			return;
+		}
+		char *p = (char*)file.data();
+		memcpy(p, &header, sizeof(header));
+		p += sizeof(header);
+		for (int v = 0; v < header.nView; v++)
+		{
+			CheckpointView view = viewOf(*m_world->cameras[v]);
+			memcpy(p, &view, sizeof(view));
+			p += sizeof(view);
+		}
+		p = writeHitpoints(p, m_hitpoints.data(), header.nHitpoint, objectIndex);
+		writeHitpoints(p, m_bgHitpoints.data(), header.nBgHitpoint, objectIndex);
+		bool ok = file.sync();
+		file.close();
+		if (!ok || !MappedFile::replace(tmpPath, m_checkpointPath))
+			cout << "Cannot write checkpoint " << m_checkpointPath << endl;
+	});
+}
+
+// 检查点须与当前场景（物体数、各相机的位姿、镜头与裁剪窗口）、随机数种子以及INIT_RADIUS、ALPHA一致，否则不载入
+bool Renderer::loadCheckpoint(double &nIter, int &iteration)
+{
+	MappedFile file;
+	if (!file.open(m_checkpointPath) || file.size() < sizeof(CheckpointHeader)) return false;
+	CheckpointHeader header;
+	memcpy(&header, file.data(), sizeof(header));
+	int nView = m_world->cameras.size();
+	if (header.magic != CHECKPOINT_MAGIC || header.version != CHECKPOINT_VERSION || header.hitpointSize != sizeof(HitPoint)
+		|| header.nObject != (int)m_world->objects.size() || header.nView != nView || header.seed != m_seed
+		|| header.initRadius != INIT_RADIUS || header.alpha != ALPHA || file.size() < checkpointSize(header))
+	{
+		cout << "Checkpoint " << m_checkpointPath << " does not match this scene, ignored" << endl;
+		return false;
+	}
+	const char *p = (const char*)file.data() + sizeof(header);
+	vector<CheckpointView> views(nView);
+	memcpy(views.data(), p, sizeof(CheckpointView) * nView);
+	p += sizeof(CheckpointView) * nView;
+	for (int v = 0; v < nView; v++)
+	{
+		CheckpointView view = viewOf(*m_world->cameras[v]);
+		if (memcmp(&views[v], &view, sizeof(view)) != 0)
+		{
+			cout << "Checkpoint " << m_checkpointPath << " does not match this scene, ignored" << endl;
+			return false;
+		}
+	}
+
+	m_scale = 1.0;
+	m_radius = header.radius;
+	m_photos.resize(nView);
+	for (int v = 0; v < nView; v++) m_photos[v].resize(views[v].height, views[v].width);
+	m_hitpoints.resize(header.nHitpoint);
+	m_bgHitpoints.resize(header.nBgHitpoint);
+	p = readHitpoints(p, m_hitpoints.data(), header.nHitpoint, m_world->objects);
+	readHitpoints(p, m_bgHitpoints.data(), header.nBgHitpoint, m_world->objects);
+	m_evalReady = false;
+
+	m_nEmitted = header.nEmitted;
+	m_nUniform = header.nUniform; m_nUniformVisible = header.nUniformVisible; m_fluxScale = header.fluxScale;
+	m_photonRate = header.photonRate; m_iterOverhead = header.iterOverhead;
+	nIter = header.nIter;
+	iteration = header.iteration;
+	cout << "Resumed from checkpoint " << m_checkpointPath << " at iteration " << iteration << endl;
+	return true;
+}
@@ -0,0 +1,128 @@
+#include "HashGridMap.h"
+#include <cmath>
+#include <climits>
+#include <algorithm>
+#include <atomic>
+using namespace std;
+
+int HashGridMap::buckets(int i, int *result) const
+{
+	const HitPoint &hp = m_data[i];
+	double r = sqrt(hp.radius2);
+	int lo[K], hi[K];
+	for (int k = 0; k < K; ++k) lo[k] = cell(hp.P[k] - r, k), hi[k] = cell(hp.P[k] + r, k);
+	int n = 0;
+	for (int x = lo[0]; x <= hi[0]; ++x) for (int y = lo[1]; y <= hi[1]; ++y) for (int z = lo[2]; z <= hi[2]; ++z)
+	{
+		int b = bucket(x, y, z);
+		if (find(result, result + n, b) == result + n) result[n++] = b;	// 不同格子可能落入同一个桶，只登记一次
+	}
+	return n;
+}
+
+void HashGridMap::build(Scheduler *scheduler)
+{
+	m_maxRadius2 = 0;
+	for (int k = 0; k < K; ++k) m_origin[k] = LONG_MAX;
+	for (int i = 0; i < m_size; ++i)
+	{
+		m_maxRadius2 = max(m_maxRadius2, m_data[i].radius2);
+		for (int k = 0; k < K; ++k) m_origin[k] = min(m_origin[k], m_data[i].P[k]);
+	}
+	m_gridRadius2 = m_maxRadius2;
+	m_cellSize = max(2 * sqrt(m_maxRadius2), EPSILON);
+
+	int nBucket = 1;
+	while (nBucket < 2 * m_size) nBucket <<= 1;
+	m_mask = nBucket - 1;
+
+	// 两遍扫描建立CSR：先统计各桶的碰撞点数，再填入编号，两遍都按碰撞点并行，以原子计数登记；
+	// 并行填入后桶内的顺序不确定，最后把各桶排序，结果与串行建立的完全相同
+	// 格子边长不小于直径，每个碰撞点通常至多覆盖2 * 2 * 2个格子，浮点误差下留足余量
+	const int GRAIN = 4096;
+	auto run = [&](long long last, const Scheduler::Func &work) {
+		if (scheduler) scheduler->parallelFor(0, last, GRAIN, work);
+		else work(0, last, 0);
+	};
+	vector<atomic<int>, MappedAllocator<atomic<int>>> next(nBucket);
+	for (int b = 0; b < nBucket; ++b) next[b].store(0, memory_order_relaxed);
+	run(m_size, [&](long long begin, long long end, int) {
+		int result[27];
+		for (int i = int(begin); i < end; ++i)
+		{
+			int n = buckets(i, result);
+			for (int j = 0; j < n; ++j) next[result[j]].fetch_add(1, memory_order_relaxed);
+		}
+	});
+	m_bucketStart.assign(nBucket + 1, 0);
+	for (int b = 0; b < nBucket; ++b)
+	{
+		m_bucketStart[b + 1] = m_bucketStart[b] + next[b].load(memory_order_relaxed);
+		next[b].store(m_bucketStart[b], memory_order_relaxed);
+	}
+	m_items.resize(m_bucketStart[nBucket]);
+	run(m_size, [&](long long begin, long long end, int) {
+		int result[27];
+		for (int i = int(begin); i < end; ++i)
+		{
+			int n = buckets(i, result);
+			for (int j = 0; j < n; ++j) m_items[next[result[j]].fetch_add(1, memory_order_relaxed)] = i;
+		}
+	});
+	run(nBucket, [&](long long begin, long long end, int) {
+		for (long long b = begin; b < end; ++b)
+			sort(m_items.begin() + m_bucketStart[b], m_items.begin() + m_bucketStart[b + 1]);
+	});
+}
+
+void HashGridMap::insertPhoton(const Photon &photon)
+{
+	if (outOfBox(photon.P)) return;
+	long long phi[3];
+	toFixed(photon.color, phi);
+	int b = bucket(cell(photon.P[0], 0), cell(photon.P[1], 1), cell(photon.P[2], 2));
+	for (int j = m_bucketStart[b]; j < m_bucketStart[b + 1]; ++j)
+	{
+		int pos = m_items[j];
+		const HitPoint &hp = m_data[pos];
+		if (photon.object == hp.object && !hp.frozen() && dot(hp.P - photon.P, hp.P - photon.P) < hp.radius2)
+			accumulate(pos, phi);
+	}
+}
+
+void HashGridMap::insertPacket(const Photon *const *packet, const long long (*phi)[3], int n, FluxCache &cache)
+{
+	// 组内的光子按空间顺序排列，常常落入同一个格子，桶的内容在缓存中复用
+	for (int i = 0; i < n; ++i)
+	{
+		const Photon &photon = *packet[i];
+		int b = bucket(cell(photon.P[0], 0), cell(photon.P[1], 1), cell(photon.P[2], 2));
+		for (int j = m_bucketStart[b]; j < m_bucketStart[b + 1]; ++j)
+		{
+			int pos = m_items[j];
+			const HitPoint &hp = m_data[pos];
+			if (photon.object == hp.object && !hp.frozen() && dot(hp.P - photon.P, hp.P - photon.P) < hp.radius2)
+				accumulate(cache, pos, phi[i]);
+		}
+	}
+}
+
+bool HashGridMap::visible(const Photon &photon) const
+{
+	if (outOfBox(photon.P)) return false;
+	int b = bucket(cell(photon.P[0], 0), cell(photon.P[1], 1), cell(photon.P[2], 2));
+	for (int j = m_bucketStart[b]; j < m_bucketStart[b + 1]; ++j)
+	{
+		const HitPoint &hp = m_data[m_items[j]];
+		if (photon.object == hp.object && !hp.frozen() && dot(hp.P - photon.P, hp.P - photon.P) < hp.radius2) return true;
+	}
+	return false;
+}
+
+void HashGridMap::refit(Scheduler *scheduler)
+{
+	double maxRadius2 = 0;
+	for (int i = 0; i < m_size; ++i) maxRadius2 = max(maxRadius2, m_data[i].radius2);
+	if (maxRadius2 < m_gridRadius2 / 4) build(scheduler);	// 最大半径已不到建网格时的一半
+	else m_maxRadius2 = maxRadius2;
+}
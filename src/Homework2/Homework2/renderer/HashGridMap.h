@@ -0,0 +1,44 @@
+#pragma once
+// 哈希网格碰撞点图类HashGridMap
+
+#include "utils.h"
+#include <cmath>
+#include <vector>
+
+/**
+哈希网格碰撞点图类HashGridMap，与KDMap接口相同，可互相替换：
+空间被划分为边长为2倍最大半径的均匀网格，每个碰撞点登记到其半径球的包围盒所覆盖的（至多8个）格子中，
+格子经哈希映射到桶，各桶的碰撞点编号连续存放（CSR格式）。查询光子时只需检查光子所在格子对应的一个桶，
+代价与碰撞点总数无关。半径缩小后原网格仍然正确，只是格子偏大；最大半径缩小到建网格时的一半以下时重建
+*/
+class HashGridMap : public HitPointMap
+{
+private:
+	double m_origin[K];		// 网格原点，即建网格时所有碰撞点的最小坐标
+	double m_cellSize;		// 格子边长
+	double m_gridRadius2;	// 建网格时的最大半径平方
+	double m_maxRadius2;	// 当前的最大半径平方
+	int m_mask;				// 桶数 - 1，桶数为2的幂
+	std::vector<int, MappedAllocator<int>> m_bucketStart;	// 第b个桶的碰撞点编号位于m_items[m_bucketStart[b], m_bucketStart[b + 1])
+	std::vector<int, MappedAllocator<int>> m_items;
+
+	// 格子坐标
+	int cell(double x, int dim) const { return int(floor((x - m_origin[dim]) / m_cellSize)); }
+	int bucket(int ix, int iy, int iz) const {
+		return int((unsigned(ix) * 73856093u ^ unsigned(iy) * 19349663u ^ unsigned(iz) * 83492791u) & unsigned(m_mask));
+	}
+	// 第i个碰撞点覆盖的格子对应的桶（已去重），返回个数；result至多27个
+	int buckets(int i, int *result) const;
+	bool outOfBox(const Vec3 &P) const { return m_size == 0 || HitPointMap::outOfBox(P, m_maxRadius2); }
+	void insertPacket(const Photon *const *packet, const long long (*phi)[3], int n, FluxCache &cache);
+	void refit(Scheduler *scheduler);	// 更新最大半径，缩小到一定程度时重建网格
+
+public:
+	HashGridMap() : m_cellSize(1), m_gridRadius2(0), m_maxRadius2(0), m_mask(0) {}
+
+	void build(Scheduler *scheduler = NULL);
+	void insertPhoton(const Photon &photon);
+	bool visible(const Photon &photon) const;
+	void update() { refit(NULL); }
+	void update(const std::vector<int> &, Scheduler *scheduler) { refit(scheduler); }
+};
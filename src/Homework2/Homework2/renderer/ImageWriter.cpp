@@ -0,0 +1,111 @@
+#include "ImageWriter.h"
+#include <algorithm>
+#include <cstdio>
+#include <cctype>
+#include <fstream>
+#include <iostream>
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+using namespace std;
+
+ImageWriter::~ImageWriter()
+{
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_quit = true;
+	}
+	m_wake.notify_one();
+	if (m_thread.joinable()) m_thread.join();	// 退出前写完所有请求
+}
+
+void ImageWriter::submit(const string &fileName, const Framebuffer &image, double exposure, const string &sidecar)
+{
+	lock_guard<mutex> lock(m_mutex);
+	if (!m_thread.joinable()) m_thread = thread(&ImageWriter::run, this);
+
+	// 同一文件的请求尚未开始写入时，直接以新图像取代
+	Job *job = NULL;
+	for (Job &pending : m_jobs) if (pending.fileName == fileName) job = &pending;
+	if (!job)
+	{
+		m_jobs.push_back(Job());
+		job = &m_jobs.back();
+		job->fileName = fileName;
+	}
+	job->image = image;
+	job->exposure = exposure;
+	job->sidecar = sidecar;
+	m_wake.notify_one();
+}
+
+void ImageWriter::flush()
+{
+	unique_lock<mutex> lock(m_mutex);
+	m_idle.wait(lock, [this]() { return m_jobs.empty() && !m_busy; });
+}
+
+void ImageWriter::run()
+{
+	unique_lock<mutex> lock(m_mutex);
+	while (true)
+	{
+		m_wake.wait(lock, [this]() { return m_quit || !m_jobs.empty(); });
+		if (m_jobs.empty()) break;	// 已请求退出且没有剩余的请求
+		Job job = move(m_jobs.front());
+		m_jobs.pop_front();
+		m_busy = true;
+		lock.unlock();
+		write(job);
+		lock.lock();
+		m_busy = false;
+		if (m_jobs.empty()) m_idle.notify_all();
+	}
+}
+
+void ImageWriter::write(const Job &job)
+{
+	string ext = job.fileName.substr(min(job.fileName.rfind('.'), job.fileName.size()));
+	transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+
+	bool ok;
+	if (ext == ".pfm")
+		ok = writePFM(job.fileName, job.image, job.exposure);
+	else
+	{
+		// 色调映射：乘以曝光倍数后截断到[0, 1]，负值与NaN映射为0，OpenCV按BGR顺序存放
+		const Framebuffer &image = job.image;
+		cv::Mat_<cv::Vec3b> img;
+		img.create(image.height(), image.width());
+		const float *p = image.data();
+		for (int i = 0; i < image.height(); i++) for (int j = 0; j < image.width(); j++, p += 3)
+			for (int k = 0; k < 3; k++)
+			{
+				double v = p[2 - k] * job.exposure;
+				img(i, j)[k] = (v > 0) ? (unsigned char)(min(v, 1.0) * 255) : 0;	// NaN与任何数比较均为假
+			}
+		ok = cv::imwrite(job.fileName, img);
+	}
+	if (!ok) cout << "Cannot write " << job.fileName << endl;
+
+	if (!job.sidecar.empty())
+	{
+		ofstream fout(job.fileName + ".crop.txt");
+		fout << job.sidecar;
+	}
+}
+
+// PFM：文本头"PF\n宽 高\n-1\n"（负的比例因子表示小端），之后为自下而上逐行的RGB浮点数
+bool ImageWriter::writePFM(const string &fileName, const Framebuffer &image, double exposure)
+{
+	FILE *file = fopen(fileName.c_str(), "wb");
+	if (!file) return false;
+	fprintf(file, "PF\n%d %d\n-1.0\n", image.width(), image.height());
+	vector<float> row(size_t(image.width()) * 3);
+	for (int i = image.height() - 1; i >= 0; i--)
+	{
+		const float *p = image.data() + size_t(i) * row.size();
+		for (size_t k = 0; k < row.size(); k++) row[k] = float(p[k] * exposure);
+		fwrite(row.data(), sizeof(float), row.size(), file);
+	}
+	return fclose(file) == 0;
+}
@@ -0,0 +1,84 @@
+#pragma once
+// 浮点帧缓冲Framebuffer，后台图像输出类ImageWriter
+
+#include "../Vec3.h"
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+/**
+浮点帧缓冲Framebuffer，单个视图的HDR图像：各像素的RGB三个分量以float连续存放，不做任何截断，
+辉度估算直接累加到其中，保存时再由ImageWriter做曝光、色调映射
+*/
+class Framebuffer
+{
+public:
+	Framebuffer() : m_height(0), m_width(0) {}
+
+	void resize(int height, int width) {
+		m_height = height; m_width = width;
+		m_data.assign(size_t(height) * width * 3, 0.0f);
+	}
+	void clear() { m_data.assign(m_data.size(), 0.0f); }
+	int height() const { return m_height; }
+	int width() const { return m_width; }
+	const float *data() const { return m_data.data(); }
+
+	Color get(int i, int j) const {
+		const float *p = &m_data[(size_t(i) * m_width + j) * 3];
+		return Color(p[0], p[1], p[2]);
+	}
+	void set(int i, int j, const Color &color) {
+		float *p = &m_data[(size_t(i) * m_width + j) * 3];
+		for (int c = 0; c < 3; c++) p[c] = float(color[c]);
+	}
+	void add(int i, int j, const Color &color) {
+		float *p = &m_data[(size_t(i) * m_width + j) * 3];
+		for (int c = 0; c < 3; c++) p[c] += float(color[c]);
+	}
+
+private:
+	int m_height, m_width;
+	std::vector<float> m_data;	// 按行存放，每像素R、G、B
+};
+
+/**
+后台图像输出类ImageWriter：渲染线程只提交一份帧缓冲的快照即返回，编码、写盘都在后台线程中完成，渲染从不等待磁盘。
+同一文件尚未开始写入的旧请求被新请求直接取代，磁盘慢于渲染时只写最新的图像。
+按扩展名选择格式：.pfm保存完整动态范围的浮点图像；其余格式先乘以曝光倍数、截断到[0, 1]，再交给OpenCV编码
+*/
+class ImageWriter
+{
+public:
+	ImageWriter() : m_busy(false), m_quit(false) {}
+	~ImageWriter();
+
+	// 提交一次写入；sidecar非空时另存为fileName + ".crop.txt"（裁剪渲染的取景信息）
+	void submit(const std::string &fileName, const Framebuffer &image, double exposure = 1.0, const std::string &sidecar = "");
+	// 等待已提交的所有请求写完
+	void flush();
+
+private:
+	struct Job
+	{
+		std::string fileName;
+		Framebuffer image;
+		double exposure;
+		std::string sidecar;
+	};
+	ImageWriter(const ImageWriter &);
+	ImageWriter &operator=(const ImageWriter &);
+	void run();
+	static void write(const Job &job);
+	static bool writePFM(const std::string &fileName, const Framebuffer &image, double exposure);
+
+	std::mutex m_mutex;
+	std::condition_variable m_wake, m_idle;
+	std::deque<Job> m_jobs;
+	bool m_busy;	// 后台线程正在写入
+	bool m_quit;
+	std::thread m_thread;	// 第一次提交时启动
+};
@@ -0,0 +1,98 @@
+#include "PreviewChannel.h"
+#include <cstring>
+#include <thread>
+using namespace std;
+
+static size_t align(size_t size) { return (size + 63) & ~size_t(63); }
+
+bool PreviewChannel::create(const string &path, const vector<pair<int, int>> &sizes)
+{
+	int nView = sizes.size();
+	size_t offset = align(sizeof(Header) + sizeof(View) * nView);
+	vector<size_t> start(nView);
+	m_capacity.resize(nView);
+	for (int v = 0; v < nView; v++)
+	{
+		start[v] = offset;
+		m_capacity[v] = size_t(sizes[v].first) * sizes[v].second * 3;
+		offset += align(sizeof(float) * m_capacity[v]);
+	}
+	if (!m_file.create(path, offset)) return false;
+
+	// 新建的文件内容全为0，seq为0表示尚未发布
+	Header *h = header();
+	h->magic = MAGIC;
+	h->nView = nView;
+	for (int v = 0; v < nView; v++)
+	{
+		views()[v].height = views()[v].width = 0;
+		views()[v].offset = start[v];
+	}
+	m_lastPhoton = 0; m_lastElapsed = 0;
+	return true;
+}
+
+bool PreviewChannel::open(const string &path)
+{
+	if (!m_file.open(path) || m_file.size() < sizeof(Header) || header()->magic != MAGIC)
+	{
+		m_file.close();
+		return false;
+	}
+	return true;
+}
+
+void PreviewChannel::publish(const vector<Framebuffer> &photos, double nIter, unsigned long long nPhoton, double elapsed)
+{
+	if (!isOpen()) return;
+	Header *h = header();
+	uint64_t seq = h->seq.load(memory_order_relaxed);
+	h->seq.store(seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	for (int v = 0; v < h->nView && v < (int)photos.size(); v++)
+	{
+		const Framebuffer &photo = photos[v];
+		size_t size = size_t(photo.height()) * photo.width() * 3;
+		if (size > m_capacity[v]) continue;	// 超过全分辨率，不应出现
+		views()[v].height = photo.height(); views()[v].width = photo.width();
+		memcpy((char*)m_file.data() + views()[v].offset, photo.data(), sizeof(float) * size);
+	}
+	double dt = elapsed - m_lastElapsed;
+	h->photonRate = (dt > 0 && nPhoton >= m_lastPhoton) ? (nPhoton - m_lastPhoton) / dt : 0;
+	h->nIter = nIter; h->nPhoton = nPhoton; h->elapsed = elapsed;
+	m_lastPhoton = nPhoton; m_lastElapsed = elapsed;
+
+	h->seq.store(seq + 2, memory_order_release);
+}
+
+bool PreviewChannel::read(int view, vector<float> &pixels, int &height, int &width, Stats &stats) const
+{
+	if (!isOpen() || view < 0 || view >= header()->nView) return false;
+	const Header *h = header();
+	while (true)
+	{
+		uint64_t seq = h->seq.load(memory_order_acquire);
+		if (seq == 0) return false;
+		if (seq & 1) { this_thread::yield(); continue; }
+
+		View info = views()[view];
+		size_t size = size_t(info.height) * info.width * 3;
+		if (info.offset + sizeof(float) * size > m_file.size())
+		{
+			if (h->seq.load(memory_order_acquire) == seq) return false;	// 文件已损坏
+			continue;
+		}
+		pixels.resize(size);
+		memcpy(pixels.data(), (const char*)m_file.data() + info.offset, sizeof(float) * size);
+		stats.nIter = h->nIter; stats.nPhoton = h->nPhoton;
+		stats.elapsed = h->elapsed; stats.photonRate = h->photonRate;
+
+		atomic_thread_fence(memory_order_acquire);
+		if (h->seq.load(memory_order_relaxed) == seq)
+		{
+			height = info.height; width = info.width;
+			return true;
+		}
+	}
+}
@@ -0,0 +1,66 @@
+#pragma once
+// 实时预览通道PreviewChannel
+
+#include "SharedState.h"
+#include "ImageWriter.h"
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+
+/**
+实时预览通道PreviewChannel：渲染器把当前的浮点帧缓冲与统计量发布到一个内存映射文件（Linux下可放在/dev/shm），
+查看程序映射同一文件，按自己的节奏读取，渲染器无需编码图像，也从不等待查看程序。布局为：
+[Header][View × nView][各视图的RGB浮点数据]，各视图按全分辨率预留空间，预览阶段的低分辨率图像只占用其开头部分。
+读写以顺序锁（seqlock）同步：写入前把seq加1（变为奇数），写完再加1（变为偶数）；读取时若seq为奇数、或读取前后seq不同，
+说明读到了写入中途的数据，重读即可
+*/
+class PreviewChannel
+{
+public:
+	static const uint32_t MAGIC = 0x50504D56;	// "PPMV"
+
+	struct View
+	{
+		int32_t height, width;	// 当前图像的尺寸，不超过全分辨率
+		uint64_t offset;		// 数据相对文件开头的偏移（字节）
+	};
+	struct Header
+	{
+		uint32_t magic;
+		int32_t nView;
+		std::atomic<uint64_t> seq;	// 顺序锁，奇数表示正在写入
+		double nIter;				// 累计的（等效）迭代轮数
+		uint64_t nPhoton;			// 已发射的光子总数
+		double elapsed;				// 渲染已用时间（秒）
+		double photonRate;			// 最近两次发布之间的光子吞吐量（个/秒）
+	};
+	struct Stats
+	{
+		double nIter;
+		uint64_t nPhoton;
+		double elapsed, photonRate;
+	};
+
+	PreviewChannel() : m_lastPhoton(0), m_lastElapsed(0) {}
+
+	// 渲染器创建通道，sizes为各视图全分辨率的高、宽；查看程序打开已有的通道
+	bool create(const std::string &path, const std::vector<std::pair<int, int>> &sizes);
+	bool open(const std::string &path);
+	void close() { m_file.close(); }
+	bool isOpen() const { return m_file.data() != NULL; }
+
+	// 发布当前图像与统计量，只由一个线程调用
+	void publish(const std::vector<Framebuffer> &photos, double nIter, unsigned long long nPhoton, double elapsed);
+	// 读取第view个视图的一致快照：pixels按行存放各像素的R、G、B；尚未发布任何图像时返回false
+	bool read(int view, std::vector<float> &pixels, int &height, int &width, Stats &stats) const;
+
+private:
+	Header *header() const { return (Header*)m_file.data(); }
+	View *views() const { return (View*)((char*)m_file.data() + sizeof(Header)); }
+
+	MappedFile m_file;
+	std::vector<size_t> m_capacity;	// 各视图预留的浮点数个数
+	unsigned long long m_lastPhoton;
+	double m_lastElapsed;
+};
@@ -0,0 +1,85 @@
+#include "ProjectionMap.h"
+#include <algorithm>
+#include <climits>
+#include <iostream>
+using namespace std;
+
+const double ProjectionMap::CAUSTIC_WEIGHT = 4.0;
+
+Vec3 ProjectionMap::direction(int t, int p, double u, double v)
+{
+	double z = -1 + 2.0 * (t + u) / N_THETA;
+	double phi = 2 * PI * (p + v) / N_PHI;
+	double r = sqrt(max(1 - z * z, 0.0));
+	return Vec3(r * cos(phi), r * sin(phi), z);
+}
+
+void ProjectionMap::build(const Vec3 &C, const vector<Object*> &objects, Scheduler &scheduler)
+{
+	const int nCell = N_THETA * N_PHI;
+	vector<char> probe(nCell, 0);	// 探测结果：0为未打中，1为打中，2为打中镜面物体
+	scheduler.parallelFor(0, nCell, 64, [&](long long begin, long long end, int) {
+	for (int cell = int(begin); cell < end; cell++)
+	{
+		int t = cell / N_PHI, p = cell % N_PHI;
+		bool hit = false, caustic = false;
+		for (int i = 0; i < N_PROBE; i++) for (int j = 0; j < N_PROBE; j++)
+		{
+			Vec3 dir = direction(t, p, (i + 0.5) / N_PROBE, (j + 0.5) / N_PROBE);
+			double maxDist = INT_MAX;
+			Object *nearestObject = NULL;
+			for (Object *object : objects)
+				if (object->intersect(C, dir, maxDist)) nearestObject = object;
+			if (!nearestObject) continue;
+			hit = true;
+			// 以镜面反射/折射为主的物体（如明珠、玻璃球）才是焦散的来源，带少量反射的地板不算
+			if (nearestObject->refl + nearestObject->refr > nearestObject->diff + nearestObject->spec) caustic = true;
+		}
+		probe[cell] = caustic ? 2 : (hit ? 1 : 0);
+	}
+	});
+
+	// 探测光线只覆盖格子内的几个点，物体的边缘可能落在探测全部落空的格子里；
+	// 把打中的区域向外扩张一格（φ方向首尾相接），紧邻打中格子的格子也获得权重，避免漏掉这部分光照
+	m_weight.assign(nCell, 0.0);
+	for (int cell = 0; cell < nCell; cell++)
+	{
+		int t = cell / N_PHI, p = cell % N_PHI;
+		if (probe[cell] == 2) { m_weight[cell] = CAUSTIC_WEIGHT; continue; }
+		bool hit = false;
+		for (int dt = -1; dt <= 1 && !hit; dt++) for (int dp = -1; dp <= 1 && !hit; dp++)
+		{
+			int t1 = t + dt, p1 = (p + dp + N_PHI) % N_PHI;
+			if (t1 >= 0 && t1 < N_THETA && probe[t1 * N_PHI + p1]) hit = true;
+		}
+		m_weight[cell] = hit ? 1.0 : 0.0;
+	}
+
+	m_cdf.resize(nCell);
+	m_total = 0;
+	int nHit = 0, nCaustic = 0;
+	for (int cell = 0; cell < nCell; cell++)
+	{
+		m_total += m_weight[cell];
+		m_cdf[cell] = m_total;
+		if (m_weight[cell] > 0) nHit++;
+		if (m_weight[cell] > 1) nCaustic++;
+	}
+	cout << "Projection map: " << nHit * 100 / nCell << "% cells hit, "
+		 << nCaustic * 100 / nCell << "% cells caustic." << endl;
+}
+
+Vec3 ProjectionMap::sample(Random &rng, double &weight) const
+{
+	// 按权重选择格子：均匀抽样时每个格子的概率为1/nCell，实际概率为m_weight[cell]/m_total
+	const int nCell = N_THETA * N_PHI;
+	double target = rng.next01() * m_total;
+	int cell = int(upper_bound(m_cdf.begin(), m_cdf.end(), target) - m_cdf.begin());
+	cell = min(cell, nCell - 1);
+	while (m_weight[cell] <= 0) cell--;	// 浮点误差落在权重为0的格子上时，退回到前一个有效格子
+	weight = m_total / (nCell * m_weight[cell]);
+
+	// 在格子内均匀抽样
+	double u = rng.next01(), v = rng.next01();
+	return direction(cell / N_PHI, cell % N_PHI, u, v);
+}
@@ -0,0 +1,38 @@
+#pragma once
+// 光源投影图ProjectionMap
+
+#include "../Object.h"
+#include "../Random.h"
+#include "Scheduler.h"
+#include <vector>
+
+/**
+光源投影图ProjectionMap，用于点光源的光子发射：
+将光源的方向球按等面积划分为N_THETA * N_PHI个格子（cosθ、φ各自均匀划分），预先向每个格子发射几条探测光线，
+标记该方向上能否打中物体、是否打中镜面反射/折射物体（焦散的来源）。
+发射时按格子的权重抽样方向：打不中任何物体的格子不再浪费光子，镜面物体所在的格子获得更多光子；
+光子能量乘以 均匀抽样的概率/实际抽样的概率 加以修正，保证光照估计不变
+*/
+class ProjectionMap
+{
+public:
+	static const int N_THETA = 64, N_PHI = 128;	// 格子的划分
+	static const int N_PROBE = 2;	// 每个格子内探测光线的分层数（共N_PROBE * N_PROBE条）
+	static const double CAUSTIC_WEIGHT;	// 打中镜面物体的格子的相对权重
+
+	ProjectionMap() : m_total(0) {}
+
+	// 以光源位置C为中心，对场景中的物体建立投影图
+	void build(const Vec3 &C, const std::vector<Object*> &objects, Scheduler &scheduler);
+	bool empty() const { return m_total <= 0; }
+	// 按格子权重抽样一个单位方向（使用3个随机数），weight返回光子能量的修正系数
+	Vec3 sample(Random &rng, double &weight) const;
+
+private:
+	// 格子(t, p)内相对坐标为(u, v)处的方向
+	static Vec3 direction(int t, int p, double u, double v);
+
+	std::vector<double> m_weight;	// 各格子的权重
+	std::vector<double> m_cdf;		// 权重的前缀和，用于二分查找抽样
+	double m_total;					// 权重之和
+};
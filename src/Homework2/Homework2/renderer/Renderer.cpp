@@ -3,110 +3,820 @@
 #include "../Light.h"
 #include "../Camera.h"
 
-#include <omp.h>
+#include <algorithm>
 #include <ctime>
-#include <fstream>
+#include <sstream>
+#include <future>
+#include <chrono>
+#include <thread>
 #include <cstdlib>
-#include <opencv2/core/core.hpp>  
-#include <opencv2/highgui/highgui.hpp>
+#include <climits>
+#include <limits>
 using namespace std;
 
-// 顶层渲染接口，分为PASS1：光线追踪；PASS2：光子发射
-void Renderer::render(World *world_)
+// 按比例scale缩放后的图像尺寸
+static int scaledSize(int size, double scale) { return max(1, int(ceil(size * scale))); }
+
+// 渲染前的准备：建立调度器、低差异序列与各光源的投影图
+void Renderer::prepare(World *world_)
 {
 	m_world = world_;
-	int height = m_world->camera->height, width = m_world->camera->width;
-	m_photo.resize(height);
-	for (int i = 0; i < height; i++) m_photo[i].resize(width);
-	for (int i = 0; i < height; i++) for (int j = 0; j < width; j++) m_photo[i][j] = Color();
+	m_renderStart = chrono::steady_clock::now();
+	delete m_hitpointMap;
+	m_hitpointMap = m_hashGrid ? (HitPointMap*)new HashGridMap : new KDMap;
+	if (!m_scheduler) m_scheduler = new Scheduler(m_nThread, m_pin);
+	cout << "Threads: " << m_scheduler->size() << endl;
+	delete m_qmc;
+	m_qmc = m_useQMC ? new QMCSequence(m_seed) : NULL;
 
+	// 投影图只与场景有关，渲染开始时为每个点光源建立一次
+	m_projMaps.assign(m_world->lights.size(), ProjectionMap());
+	if (m_useProjMap)
+		for (int l = 0; l < (int)m_world->lights.size(); l++)
+			if (PointLight *pointLight = dynamic_cast<PointLight*>(m_world->lights[l]))
+				m_projMaps[l].build(pointLight->C, m_world->objects, *m_scheduler);
+
+	// 预览通道按各视图的全分辨率预留空间
+	m_channel.close();
+	if (!m_channelPath.empty())
+	{
+		vector<pair<int, int>> sizes;
+		for (Camera *camera : m_world->cameras) sizes.push_back(make_pair(camera->imgHeight(), camera->imgWidth()));
+		if (!m_channel.create(m_channelPath, sizes)) cout << "Cannot create preview channel " << m_channelPath << endl;
+	}
+}
+
+// 顶层渲染接口，分为PASS1：光线追踪；PASS2：光子发射
+// 多个相机（视图）的碰撞点合并在同一张碰撞点图中，PASS2的光子只需发射一遍即可同时更新所有视图
+// 开启预览时，先以1/2^level的分辨率、更少的光子、更大的半径迭代几轮，再逐级细化到全分辨率
+void Renderer::render(World *world_)
+{
+	this->prepare(world_);
 	int startTime = clock();
-	// PASS1: Ray Tracing
-	for (int i = 0; i < height; i++) for (int j = 0; j < width; j++)
+	double nIter = 0;	// 累计的（等效）迭代轮数，跨越各级分辨率连续计数
+	int firstIter = 0;	// 全分辨率下从第几轮开始迭代
+	bool checkpoint = !m_checkpointPath.empty() && !m_probabilistic;
+	bool resumed = checkpoint && this->loadCheckpoint(nIter, firstIter);	// 从检查点恢复时直接进入全分辨率
+	m_lastCheckpoint = chrono::steady_clock::now();
+	double fullCost = 0;	// 按上一级预览估算的全分辨率PASS1加一轮迭代的用时（像素数、光子数均为4^level倍）
+	bool previewed = false;	// 是否已输出过预览图像
+	for (int level = resumed ? 0 : m_nPreviewLevel; level >= 0; level--)
 	{
-		HitPoint hp(i, j, Vec3(1.0, 1.0, 1.0));
-		// 有景深效果，则增加随机采样环节
-		if (m_world->camera->aperture > EPSILON)
+		double scale = 1.0 / (1 << level);
+		m_radius = INIT_RADIUS / scale;
+		auto levelStart = chrono::steady_clock::now();
+
+		// 剩余预算不够全分辨率的PASS1与一轮迭代时跳过其余预览；全分辨率开始前预算已用完时，交付最后一级预览的图像
+		if (level > 0 && this->outOfBudget(fullCost)) continue;
+		if (level == 0 && previewed && this->outOfBudget(0))
+		{
+			cout << "Out of budget before full resolution, delivering the preview." << endl;
+			this->saveImg("update.jpg");
+			break;
+		}
+
+		// PASS1: Ray Tracing，从检查点恢复时碰撞点已经载入
+		if (!resumed)
+		{
+			this->rayTracePass(scale, nIter);
+			cout << "Elapsed time: " << (clock() - startTime) / CLOCKS_PER_SEC << "s." << endl;
+			if (level == 0) this->saveImg("RT.jpg");
+		}
+		double pass1Time = chrono::duration<double>(chrono::steady_clock::now() - levelStart).count();
+
+		int nLevelIter = (level > 0) ? m_nPreviewIter : MAX_PPM_ITER;
+		if (m_probabilistic)
 		{
-			int nSample = m_world->camera->nSample;
-			hp.weight /= nSample;
-			for (int k = 0; k < nSample; k++)
+			// PASS2: 概率渐进式光子映射，各轮迭代互相独立
+			nIter += this->probabilisticPass(PPPM_PHOTON_NUM >> (2 * level), nLevelIter);
+			if (level > 0)
 			{
-				auto ray = m_world->camera->rayAperture(i, j);
-				Vec3 apertOri = ray.first, apertDir = ray.second;
-				m_photo[i][j] += traceRay(hp, apertOri, apertDir, 0);
+				this->saveImg("preview.jpg");
+				previewed = true;
+				double pass2Time = chrono::duration<double>(chrono::steady_clock::now() - levelStart).count() - pass1Time;
+				fullCost = (pass1Time + pass2Time / nLevelIter) * (1 << (2 * level));
 			}
-			m_photo[i][j] /= nSample;
-		} else	// 否则无景深，纯RT
+			continue;
+		}
+
+		// PASS2: Photon tracing
+		m_hitpointMap->init(m_hitpoints.size(), m_hitpoints.data(), m_scheduler);	// 建立碰撞点图
+
+		// 渐进式发射光子，预览时每轮的光子数随像素数一同减少
+		// nPhoton为参考光子数，发射nPhoton个光子（携带光源的全部能量）记为一轮迭代；
+		// 设置了目标时间时每轮实际发射nBatch个光子，单个光子的能量不变，本轮记为nBatch / nPhoton轮
+		int nPhoton = MAX_PHOTON_NUM >> (2 * level);
+		// 碰撞点已重建，马尔可夫链需重新寻找可见路径，可见路径的比例也需重新统计，
+		// 否则上一级分辨率的统计量会混入本级的归一化；从检查点恢复时沿用载入的统计量
+		m_chains.clear();
+		if (!resumed) { m_nUniform = m_nUniformVisible = 0; m_fluxScale = 1.0; }
+		double iterTime = 0;	// 上一轮的用时，用于判断剩余时间是否还够一轮
+		int first = (level == 0) ? firstIter : 0, done = first;
+		for (int i = first; i < nLevelIter; i++)
 		{
-			Vec3 ori = m_world->camera->C;
-			Vec3 dir = m_world->camera->ray(i, j);
-			m_photo[i][j] = traceRay(hp, ori, dir, 0);
+			if (i > first && this->outOfBudget(iterTime)) break;	// 至少迭代一轮，保证有图像可交付
+			auto iterStart = chrono::steady_clock::now();
+			int nBatch = this->batchSize(nPhoton);
+			double weight = double(nBatch) / nPhoton;
+
+			// 流水线：本轮发射光子的同时，后台线程仍在估算、保存上一轮的图像
+			// 光子只写入碰撞点图的累加器，不改动碰撞点的半径与光通量，因此两者可以并行
+			if (m_adaptive) this->emitPhotonsAdaptive(nBatch, weight);
+			else this->emitPhotons(nBatch, weight);
+			double emitTime = chrono::duration<double>(chrono::steady_clock::now() - iterStart).count();
+			cout << "Elapsed time: " << (clock() - startTime) / CLOCKS_PER_SEC << "s." << endl;
+
+			// 每一轮光子发射结束后，更新KdMap；更新会改动碰撞点，需先等待上一轮的输出完成
+			this->finishOutput();
+			this->updateKDMap();
+			if (m_outOfCore && m_residentLimit > 0 && MappedMemory::mappedSize() > m_residentLimit) MappedMemory::trim();
+
+			// 估算辉度、保存图像，交给后台线程完成
+			double iter = (nIter += weight);
+			double fluxScale = m_fluxScale;
+			bool converged = (m_noiseTarget > 0) && this->checkConvergence(iter, fluxScale);
+			unsigned long long nEmitted = m_nEmitted;
+			m_output = async(launch::async, [this, iter, fluxScale, nEmitted]() {
+				this->evalIrradiance(iter, fluxScale);
+				this->saveImg("update.jpg");
+				this->publishPreview(iter, nEmitted);
+			});
+			done = i + 1;
+			if (level == 0 && checkpoint &&
+				chrono::duration<double>(chrono::steady_clock::now() - m_lastCheckpoint).count() >= m_checkpointInterval)
+				this->saveCheckpoint(iter, done);
+			iterTime = chrono::duration<double>(chrono::steady_clock::now() - iterStart).count();
+			this->measureBatch(nBatch, emitTime, iterTime);
+			if (level > 0 && i == first)
+				fullCost = chrono::duration<double>(chrono::steady_clock::now() - levelStart).count() * (1 << (2 * level));
+			if (converged)
+			{
+				cout << "Converged after " << iter << " iterations." << endl;
+				break;
+			}
+		}
+		this->finishOutput();
+		if (level > 0) { this->saveImg("preview.jpg"); previewed = true; }
+		else if (checkpoint)
+		{
+			// 渲染结束、停止或预算用完时再写一次，下一次渲染（如下一个时间片）可从此处继续
+			this->saveCheckpoint(nIter, done);
+			this->finishOutput();
 		}
 	}
-	cout << "Elapsed time: " << (clock() - startTime) / CLOCKS_PER_SEC << "s." << endl;
+}
+
+// 多进程渲染的协调进程：完成PASS1后把碰撞点发布到共享文件path中，由nWorker个工作进程发射光子，
+// 本进程每轮合并各工作进程报告的光通量增量、更新碰撞点的半径（HitPoint::update）并输出图像。
+// 每个工作进程每轮发射MAX_PHOTON_NUM个光子、携带光源的全部能量，相当于一轮迭代，因此本轮有几个进程报告就计几轮；
+// 等待超过timeout秒仍未报告的工作进程（如已崩溃）本轮不计入，渲染照常继续；
+// 所有工作进程都未报告时本轮保持不变，等重新启动的工作进程完成，连续MAX_IDLE次超时仍无报告则结束渲染
+void Renderer::renderCoordinator(World *world_, const string &path, int nWorker, double timeout)
+{
+	this->prepare(world_);
+	this->rayTracePass(1.0, 0);
 	this->saveImg("RT.jpg");
+	m_hitpointMap->init(m_hitpoints.size(), m_hitpoints.data(), m_scheduler);
+	int nHitpoint = 0;
+	HitPoint *hitpoints = m_hitpointMap->data(nHitpoint);	// 建树后的碰撞点顺序
+
+	SharedState shared;
+	if (!shared.create(path, nHitpoint, nWorker, MAX_PHOTON_NUM))
+	{
+		cout << "Cannot create shared file " << path << endl;
+		return;
+	}
+	// 发布碰撞点的位置、所在物体与半径
+	SharedState::Header *header = shared.header();
+	SharedState::HitPoint *shared_hp = shared.hitpoints();
+	const vector<Object*> &objects = m_world->objects;
+	for (int i = 0; i < nHitpoint; i++)
+	{
+		for (int k = 0; k < 3; k++) shared_hp[i].P[k] = hitpoints[i].P[k];
+		shared_hp[i].object = int(find(objects.begin(), objects.end(), hitpoints[i].object) - objects.begin());
+		shared_hp[i].radius2 = hitpoints[i].radius2;
+	}
+	header->timeout = timeout;
+	header->epoch.store(1);
+
+	// 心跳线程：工作进程据此判断协调进程是否存活，与合并、输出的耗时无关
+	atomic<bool> alive(true);
+	thread heartbeat([header, &alive]() {
+		while (alive) { header->heartbeat.fetch_add(1); this_thread::sleep_for(chrono::milliseconds(100)); }
+	});
+
+	const int MAX_IDLE = 10;
+	int startTime = clock();
+	int nIter = 0, nIdle = 0;
+	long long epoch = 1;
+	while (nIter < MAX_PPM_ITER && (epoch == 1 || !this->outOfBudget(0)))
+	{
+		// 等待所有工作进程报告本轮，超时后不再等待其余进程
+		vector<int> reported;
+		auto deadline = chrono::steady_clock::now() + chrono::duration<double>(timeout);
+		while (true)
+		{
+			reported.clear();
+			for (int w = 0; w < nWorker; w++)
+				if (shared.slot(w)->epoch.load(memory_order_acquire) == epoch) reported.push_back(w);
+			if ((int)reported.size() == nWorker || chrono::steady_clock::now() > deadline) break;
+			this_thread::sleep_for(chrono::milliseconds(10));
+		}
+		if (reported.empty())
+		{
+			cout << "Epoch " << epoch << ": no worker reported" << endl;
+			if (++nIdle >= MAX_IDLE) { cout << "No worker alive, stopping" << endl; break; }
+			continue;
+		}
+		nIdle = 0;
+		if ((int)reported.size() < nWorker)
+			cout << "Epoch " << epoch << ": " << nWorker - reported.size() << " worker(s) timed out" << endl;
+
+		// 合并增量、更新半径，再发布下一轮；更新会改动碰撞点，需先等待上一轮的输出完成
+		this->finishOutput();
+		m_scheduler->parallelFor(0, nHitpoint, 4096, [&](long long begin, long long end, int) {
+			for (long long i = begin; i < end; i++)
+			{
+				HitPoint &hp = hitpoints[i];
+				for (int w : reported)
+				{
+					const SharedState::Delta &delta = shared.deltas(w)[i];
+					for (int c = 0; c < 3; c++) hp.phi[c] += delta.phi[c];
+					hp.nNew += delta.nNew;
+				}
+				hp.update(ALPHA);
+				shared_hp[i].radius2 = hp.radius2;
+			}
+		});
+		m_hitpointMap->update();
+		m_touchAll = true;
+		header->epoch.store(++epoch, memory_order_release);
 
+		nIter += reported.size();
+		cout << "Iteration " << nIter << ", elapsed time: " << (clock() - startTime) / CLOCKS_PER_SEC << "s." << endl;
+		int iter = nIter;
+		unsigned long long nTotal = (unsigned long long)nIter * MAX_PHOTON_NUM;
+		m_output = async(launch::async, [this, iter, nTotal]() {
+			this->evalIrradiance(iter, 1.0);
+			this->saveImg("update.jpg");
+			this->publishPreview(iter, nTotal);
+		});
+	}
+	this->finishOutput();
+	header->done.store(1);
+	alive = false;
+	heartbeat.join();
+}
 
-	// PASS2: Photon tracing
-	m_kdMap.init(m_hitpoints.size(), m_hitpoints.data());	// 建立碰撞点图
+// 多进程渲染的工作进程：打开协调进程发布的共享文件path，以第worker个槽位参与渲染。
+// 每轮读取碰撞点的当前半径，在自己的碰撞点图副本上发射一轮光子，再把各碰撞点的光通量增量写入槽位；
+// 光子的全局编号由轮次和worker决定，各进程的光子互不重复。可随时启动、崩溃后可重新启动
+void Renderer::renderWorker(World *world_, const string &path, int worker)
+{
+	this->prepare(world_);
+	SharedState shared;
+	while (!shared.open(path) || shared.header()->epoch.load(memory_order_acquire) == 0)
+		this_thread::sleep_for(chrono::milliseconds(100));	// 等待协调进程完成PASS1
+	SharedState::Header *header = shared.header();
+	if (worker < 0 || worker >= header->nWorker)
+	{
+		cout << "Worker " << worker << " out of range [0, " << header->nWorker << ")" << endl;
+		return;
+	}
 
-	// 渐进式发射光子
-	for (int i = 0; i < MAX_PPM_ITER; i++)
+	// 由共享文件重建碰撞点，只需位置、所在物体与半径
+	int nHitpoint = header->nHitpoint, nPhoton = header->nPhoton;
+	const SharedState::HitPoint *shared_hp = shared.hitpoints();
+	m_hitpoints.assign(nHitpoint, HitPoint());
+	for (int i = 0; i < nHitpoint; i++)
 	{
-		// 计算所有光源的能量和
-		double totalPower = 0.0;
-		for (Light *light : m_world->lights)
-			totalPower += light->color.power();
+		HitPoint &hp = m_hitpoints[i];
+		hp.P = Vec3(shared_hp[i].P[0], shared_hp[i].P[1], shared_hp[i].P[2]);
+		hp.object = m_world->objects[shared_hp[i].object];
+		hp.radius2 = shared_hp[i].radius2;
+	}
+	m_hitpointMap->init(nHitpoint, m_hitpoints.data(), m_scheduler);
+	HitPoint *hitpoints = m_hitpointMap->data(nHitpoint);	// 与m_hitpoints为同一数组
 
-		// 单个光子的能量：总能量/光子数
-		double photonPower = totalPower / MAX_PHOTON_NUM;
+	SharedState::Slot *slot = shared.slot(worker);
+	SharedState::Delta *deltas = shared.deltas(worker);
+	long long lastEpoch = 0, lastBeat = header->heartbeat.load();
+	auto lastBeatTime = chrono::steady_clock::now();
+	while (!header->done.load())
+	{
+		// 心跳有变化就记下时间；停止超过timeout秒，认为协调进程已崩溃
+		long long beat = header->heartbeat.load();
+		if (beat != lastBeat) { lastBeat = beat; lastBeatTime = chrono::steady_clock::now(); }
+		else if (chrono::duration<double>(chrono::steady_clock::now() - lastBeatTime).count() > header->timeout)
+		{
+			cout << "Worker " << worker << ": coordinator stopped responding" << endl;
+			return;
+		}
+		long long epoch = header->epoch.load(memory_order_acquire);
+		if (epoch == lastEpoch) { this_thread::sleep_for(chrono::milliseconds(1)); continue; }
 
-		// 各个光源发射光子
-		for (Light *light : m_world->lights)
+		// 读取本轮的半径；若读取期间协调进程已进入下一轮，则重新读取
+		for (int i = 0; i < nHitpoint; i++)
+		{
+			hitpoints[i].radius2 = shared_hp[i].radius2;
+			hitpoints[i].phi = Color(0, 0, 0);
+			hitpoints[i].nNew = 0;
+		}
+		if (header->epoch.load(memory_order_acquire) != epoch) continue;
+		m_hitpointMap->update();
+
+		m_nEmitted = ((unsigned long long)(epoch - 1) * header->nWorker + worker) * nPhoton;
+		this->emitPhotons(nPhoton);
+		m_scheduler->parallelFor(0, nHitpoint, 4096, [&](long long begin, long long end, int) {
+			m_hitpointMap->flush(int(begin), int(end));
+		});
+
+		// 协调进程已因超时进入下一轮时，本轮结果作废
+		lastEpoch = epoch;
+		if (header->epoch.load(memory_order_acquire) != epoch) continue;
+		for (int i = 0; i < nHitpoint; i++)
+		{
+			for (int c = 0; c < 3; c++) deltas[i].phi[c] = hitpoints[i].phi[c];
+			deltas[i].nNew = hitpoints[i].nNew;
+		}
+		slot->epoch.store(epoch, memory_order_release);
+		cout << "Worker " << worker << " finished epoch " << epoch << endl;
+	}
+}
+
+// 把当前图像发布到预览通道：只是一次内存拷贝，且在后台输出线程中进行，不占用渲染循环的时间
+void Renderer::publishPreview(double nIter, unsigned long long nPhoton)
+{
+	if (!m_channel.isOpen()) return;
+	double elapsed = chrono::duration<double>(chrono::steady_clock::now() - m_renderStart).count();
+	m_channel.publish(m_photos, nIter, nPhoton, elapsed);
+}
+
+// 等待后台线程完成上一轮的辉度估算与图像保存，以及检查点的写入；此后才能改动碰撞点
+void Renderer::finishOutput()
+{
+	if (m_output.valid()) m_output.get();
+	if (m_checkpoint.valid()) m_checkpoint.get();
+}
+
+// 以scale的分辨率对所有视图做光线追踪，重建碰撞点；若此前已有更粗糙一级的碰撞点，则继承其光子统计量
+void Renderer::rayTracePass(double scale, double nIter)
+{
+	HitPointArray coarse;
+	coarse.swap(m_hitpoints);
+	m_evalReady = false;
+	m_bgHitpoints.clear();
+	double coarseScale = m_scale;
+	m_scale = scale;
+
+	int nView = m_world->cameras.size();
+	m_photos.resize(nView);
+	for (int v = 0; v < nView; v++)
+	{
+		int height = scaledSize(m_world->cameras[v]->imgHeight(), scale);
+		int width = scaledSize(m_world->cameras[v]->imgWidth(), scale);
+		m_photos[v].resize(height, width);
+	}
+	for (int v = 0; v < nView; v++) this->rayTrace(v);
+
+	// 超大图像模式下按空间顺序重排碰撞点，KD树叶结点附近的碰撞点、同一批光子命中的碰撞点都落在相邻的页上
+	if (m_outOfCore)
+	{
+		double boxMin[3], boxMax[3];
+		for (int k = 0; k < 3; k++) boxMin[k] = numeric_limits<double>::max(), boxMax[k] = numeric_limits<double>::lowest();
+		for (const HitPoint &hp : m_hitpoints) for (int k = 0; k < 3; k++)
+			boxMin[k] = min(boxMin[k], hp.P[k]), boxMax[k] = max(boxMax[k], hp.P[k]);
+		vector<pair<uint64_t, int>, MappedAllocator<pair<uint64_t, int>>> keys(m_hitpoints.size());
+		for (int i = 0; i < (int)m_hitpoints.size(); i++) keys[i] = make_pair(mortonCode(m_hitpoints[i].P, boxMin, boxMax), i);
+		sort(keys.begin(), keys.end());
+		HitPointArray sorted;
+		sorted.reserve(m_hitpoints.size());
+		for (const pair<uint64_t, int> &key : keys) sorted.push_back(m_hitpoints[key.second]);
+		m_hitpoints.swap(sorted);
+	}
+
+	// 新的碰撞点从第nIter轮之后开始累计光子
+	for (HitPoint &hp : m_hitpoints) hp.iter0 = nIter;
+	if (!coarse.empty()) this->inheritHitpoints(coarse, coarseScale);
+}
+
+// 从粗糙一级的碰撞点继承光子统计量：同一视图中覆盖同一位置、位于同一物体上、且落在其半径之内的粗糙碰撞点，
+// 其光子密度估计对新碰撞点依然有效；按面积比例缩小到新的半径后，新碰撞点的辉度估计与继承前相同
+void Renderer::inheritHitpoints(const HitPointArray &coarse, double coarseScale)
+{
+	// 按粗糙图像的像素对碰撞点分桶（计数排序）
+	int nView = m_world->cameras.size();
+	vector<int> base(nView + 1, 0), coarseHeight(nView), coarseWidth(nView);
+	for (int v = 0; v < nView; v++)
+	{
+		coarseHeight[v] = scaledSize(m_world->cameras[v]->imgHeight(), coarseScale);
+		coarseWidth[v] = scaledSize(m_world->cameras[v]->imgWidth(), coarseScale);
+		base[v + 1] = base[v] + coarseHeight[v] * coarseWidth[v];
+	}
+	vector<int> start(base[nView] + 1, 0), index(coarse.size());
+	for (const HitPoint &hp : coarse) start[base[hp.view] + hp.row * coarseWidth[hp.view] + hp.col + 1]++;
+	for (int i = 0; i < base[nView]; i++) start[i + 1] += start[i];
+	vector<int> fill(start.begin(), start.end() - 1);
+	for (int i = 0; i < (int)coarse.size(); i++)
+	{
+		const HitPoint &hp = coarse[i];
+		index[fill[base[hp.view] + hp.row * coarseWidth[hp.view] + hp.col]++] = i;
+	}
+
+	double ratio = coarseScale / m_scale;
+	for (HitPoint &hp : m_hitpoints)
+	{
+		int row = min(int((hp.row + 0.5) * ratio), coarseHeight[hp.view] - 1);
+		int col = min(int((hp.col + 0.5) * ratio), coarseWidth[hp.view] - 1);
+		int pixel = base[hp.view] + row * coarseWidth[hp.view] + col;
+
+		// 在对应的粗糙像素中寻找最近的有效碰撞点
+		const HitPoint *best = NULL;
+		double bestDist2 = 0;
+		for (int k = start[pixel]; k < start[pixel + 1]; k++)
+		{
+			const HitPoint &old = coarse[index[k]];
+			double dist2 = (old.P - hp.P).length2();
+			if (old.object == hp.object && dist2 < old.radius2 && (!best || dist2 < bestDist2))
+				best = &old, bestDist2 = dist2;
+		}
+		if (!best) continue;
+
+		double k = min(hp.radius2 / best->radius2, 1.0);
+		hp.phi = best->phi * k;
+		hp.nAccum = best->nAccum * k; hp.nNew = best->nNew * k;
+		hp.radius2 = best->radius2 * k;
+		hp.iter0 = best->iter0;
+	}
+}
+
+// 所有光源按能量比例，共发射nPhoton个光子；每轮发射的总能量与光子数无关
+// 按能量将nPhoton个光子分配给各个光源：所有光源的光子按编号连成一条任务流，第l个光源占据[offset[l], offset[l + 1])，
+// 每个光子的能量为photonColor[l]，所有光子的能量之和为光源总能量的weight倍
+void Renderer::lightPhotons(int nPhoton, vector<long long> &offset, vector<Color> &photonColor, double weight) const
+{
+	// 计算所有光源的能量和
+	double totalPower = 0.0;
+	for (Light *light : m_world->lights)
+		totalPower += light->color.power();
+
+	// 单个光子的能量：总能量/光子数
+	double photonPower = totalPower / nPhoton;
+
+	int nLight = m_world->lights.size();
+	offset.assign(nLight + 1, 0);
+	photonColor.assign(nLight, Color());
+	for (int l = 0; l < nLight; l++)
+	{
+		Light *light = m_world->lights[l];
+		long long nLightPhoton = (long long)(light->color.power() / photonPower);	// 本光源发射的光子数
+		offset[l + 1] = offset[l] + nLightPhoton;
+		if (nLightPhoton > 0) photonColor[l] = light->color * weight / double(nLightPhoton);	// 本光源的光子能量
+	}
+}
+
+// 从第l个光源发射一个能量为color的光子
+Photon Renderer::emitPhoton(int l, const Color &color, Random &rng) const
+{
+	Light *light = m_world->lights[l];
+	const ProjectionMap *projMap = m_projMaps[l].empty() ? NULL : &m_projMaps[l];
+	// 在光源上随机选择光线始点、方向；使用投影图时按格子权重抽样方向，并修正光子能量
+	Vec3 ori = light->randomPoint(rng);
+	double weight = 1.0;
+	Vec3 dir = projMap ? projMap->sample(rng, weight) : Vec3::random(rng);
+	return Photon(ori, dir, color * weight);
+}
+
+void Renderer::emitPhotons(int nPhoton, double weight)
+{
+	int nLight = m_world->lights.size();
+	vector<long long> offset;
+	vector<Color> photonColor;
+	this->lightPhotons(nPhoton, offset, photonColor, weight);
+
+	// 交给调度器并行，路径长短不一的光子由工作窃取自动均衡；每个光子的随机数只由种子和光子的全局编号决定，与线程无关
+	// 光子编号跨越各轮迭代连续递增，低差异序列的分层性质在渐进过程中得以保持
+	// 波前模式下每个任务块即一个波前，块内光子先全部发射，再逐级批量追踪
+	// 否则落点先存入执行线程自己的缓冲区，攒满LANDING_BATCH个再批量写入碰撞点图
+	unsigned long long base = m_nEmitted;
+	vector<vector<Photon>> landings(m_scheduler->size());
+	m_scheduler->parallelFor(0, offset[nLight], m_wavefront ? WAVEFRONT_SIZE : PHOTON_GRAIN, [&](long long begin, long long end, int worker) {
+		int l = int(upper_bound(offset.begin(), offset.end(), begin) - offset.begin()) - 1;
+		vector<PhotonState> wave;
+		if (m_wavefront) wave.reserve(size_t(end - begin));
+		for (long long j = begin; j < end; j++)
+		{
+			while (j >= offset[l + 1]) l++;
+			if (j % 100000 == 0) cout << "j = " << j << endl;
+			Random rng(m_seed, Random::PHOTON, base + j, m_qmc);
+			Photon photon = this->emitPhoton(l, photonColor[l], rng);
+			if (m_wavefront)
+				wave.push_back(PhotonState(photon.ori, photon.dir, photon.color, base + j));
+			else
+				tracePhoton(photon, 0, rng, &landings[worker]);
+		}
+		if (m_wavefront) traceWavefront(wave);
+		else if (landings[worker].size() >= LANDING_BATCH)
+		{
+			m_hitpointMap->insertPhotons(landings[worker]);
+			landings[worker].clear();
+		}
+	});
+	// 写入各线程缓冲区中剩余的落点
+	m_scheduler->parallelFor(0, landings.size(), 1, [&](long long begin, long long end, int) {
+		for (long long w = begin; w < end; w++) m_hitpointMap->insertPhotons(landings[w]);
+	});
+	m_nEmitted += offset[nLight];
+}
+
+// 概率渐进式光子映射（Knaus & Zwicker 2011）：第i轮迭代发射nPhoton个光子并为其建立光子图，
+// 以全局半径r_i^2 = r_1^2 * Π_{k=1}^{i-1} (k + α) / (k + 1)在各碰撞点处收集光子，最终图像为各轮估计值的平均。
+// 各轮之间不共享可变状态，每批同时进行若干轮：光子追踪按光子块并行，各轮的光子图各由一个线程建立，收集按碰撞点并行。
+// 每批的轮数受内存预算m_pppmMemory限制：第一批只做一轮，此后按测得的每轮光子图大小决定，且不超过线程数。
+// 每个碰撞点只由一个线程收集，各轮的估计值按轮次顺序直接累加到m_pppmSum，结果与线程数、分批方式无关
+int Renderer::probabilisticPass(int nPhoton, int nLevelIter)
+{
+	int nHitpoint = m_hitpoints.size(), nWorker = m_scheduler->size();
+	m_pppmSum.assign(nHitpoint, Color(0, 0, 0));
+
+	vector<long long> offset;
+	vector<Color> photonColor;
+	this->lightPhotons(nPhoton, offset, photonColor);
+	long long nIterPhoton = offset.back();
+	int nChunk = int((nIterPhoton + PHOTON_GRAIN - 1) / PHOTON_GRAIN);	// 每轮的光子块数
+
+	// 碰撞点的包围盒：落点离它超过收集半径时不会被任何碰撞点收集，不必存入光子图
+	double boxMin[3], boxMax[3];
+	for (int k = 0; k < 3; k++) boxMin[k] = numeric_limits<double>::max(), boxMax[k] = numeric_limits<double>::lowest();
+	for (const HitPoint &hp : m_hitpoints) for (int k = 0; k < 3; k++)
+		boxMin[k] = min(boxMin[k], hp.P[k]), boxMax[k] = max(boxMax[k], hp.P[k]);
+	auto outOfBox = [&](const Vec3 &P, double radius2) {
+		for (int k = 0; k < 3; k++)
 		{
-			int nPhoton = light->color.power() / photonPower;	// 本光源发射的光子数
-			Vec3 photonColor = light->color / nPhoton;	// 本光源的光子能量
+			double d = max(boxMin[k] - P[k], P[k] - boxMax[k]);
+			if (d > 0 && d * d > radius2) return true;
+		}
+		return false;
+	};
 
-			// OpenMP多线程加速
-			omp_set_dynamic(0);
-			omp_set_num_threads(8);
-#pragma omp parallel
+	int startTime = clock();
+	double radius2 = m_radius * m_radius;	// 下一轮的半径平方
+	int first = 0, nBatch = 1;
+	while (first < nLevelIter && (first == 0 || !this->outOfBudget(0)))
+	{
+		int last = min(first + nBatch, nLevelIter), n = last - first;
+		vector<double> iterRadius2(n);
+		for (int i = first; i < last; i++)
+		{
+			iterRadius2[i - first] = radius2;
+			radius2 *= (i + 1 + ALPHA) / (i + 2);
+		}
+
+		// 追踪本批各轮的全部光子，只记录包围盒附近的落点；各光子块的落点分开存放、按块的顺序拼接，光子图与线程数无关
+		unsigned long long base = m_nEmitted;
+		vector<vector<PhotonMap::Node>> chunkNodes(size_t(n) * nChunk);
+		m_scheduler->parallelFor(0, chunkNodes.size(), 1, [&](long long begin, long long end, int) {
+			vector<Photon> landings;
+			for (long long t = begin; t < end; t++)
 			{
-				srand(int(time(NULL)) ^ omp_get_thread_num());	// rand()线程不安全，需重新设定随机种子
-#pragma omp for
-				for (int j = 0; j < nPhoton; j++)
+				long long i = t / nChunk, j0 = (t % nChunk) * PHOTON_GRAIN, j1 = min(j0 + PHOTON_GRAIN, nIterPhoton);
+				int l = 0;
+				for (long long j = j0; j < j1; j++)
 				{
-					if (j % 100000 == 0) cout << "j = " << j << endl;
-					// 在光源上随机选择光线始点、方向
-					Vec3 ori = light->randomPoint();
-					Vec3 dir = Vec3::random();
-					Photon photon(ori, dir, photonColor);
-					tracePhoton(photon, 0);
+					while (j >= offset[l + 1]) l++;
+					Random rng(m_seed, Random::PHOTON, base + i * nIterPhoton + j, m_qmc);
+					Photon photon = this->emitPhoton(l, photonColor[l], rng);
+					landings.clear();
+					tracePhoton(photon, 0, rng, &landings);
+					for (const Photon &landing : landings)
+						if (!outOfBox(landing.P, iterRadius2[i])) chunkNodes[t].push_back(PhotonMap::Node(landing));
 				}
 			}
-		}
-		cout << "Elapsed time: " << (clock() - startTime) / CLOCKS_PER_SEC << "s." << endl;
+		});
+		vector<PhotonMap> photonMaps(n);
+		m_scheduler->parallelFor(0, n, 1, [&](long long begin, long long end, int) {
+			for (long long i = begin; i < end; i++)
+			{
+				size_t size = 0;
+				for (int c = 0; c < nChunk; c++) size += chunkNodes[i * nChunk + c].size();
+				vector<PhotonMap::Node> nodes;
+				nodes.reserve(size);
+				for (int c = 0; c < nChunk; c++)
+				{
+					vector<PhotonMap::Node> &chunk = chunkNodes[i * nChunk + c];
+					nodes.insert(nodes.end(), chunk.begin(), chunk.end());
+					vector<PhotonMap::Node>().swap(chunk);
+				}
+				photonMaps[i].build(nodes);
+			}
+		});
 
-		// 每一轮光子发射结束后，更新KdMap
-		this->updateKDMap();
+		// 在各碰撞点处收集本批各轮的光子，累加到估计值之和；需先等待上一批的输出完成
+		this->finishOutput();
+		m_scheduler->parallelFor(0, nHitpoint, 1024, [&](long long begin, long long end, int) {
+			for (long long k = begin; k < end; k++)
+			{
+				const HitPoint &hp = m_hitpoints[k];
+				for (int i = 0; i < n; i++)
+				{
+					double r2 = iterRadius2[i];
+					m_pppmSum[k] += photonMaps[i].gather(hp.P, hp.object, r2) * (10000.0 / r2);
+				}
+			}
+		});
+		m_nEmitted += n * nIterPhoton;
+		cout << "PPPM iteration " << last << ", elapsed time: " << (clock() - startTime) / CLOCKS_PER_SEC << "s." << endl;
 
-		// 估算辉度
-		this->evalIrradiance(i + 1);
+		// 光子图拼接时需要两倍的空间，按此估计每轮的内存，决定下一批的轮数
+		size_t iterBytes = 1;
+		for (const PhotonMap &photonMap : photonMaps) iterBytes = max(iterBytes, 2 * sizeof(PhotonMap::Node) * photonMap.size());
+		nBatch = int(max(size_t(1), min(size_t(nWorker), m_pppmMemory / iterBytes)));
+		photonMaps.clear();
+		first = last;
+		unsigned long long nEmitted = m_nEmitted;
+		m_output = async(launch::async, [this, last, nEmitted]() {
+			this->evalProbabilistic(last);
+			this->saveImg("update.jpg");
+			this->publishPreview(last, nEmitted);
+		});
+	}
+	this->finishOutput();
+	return min(first, nLevelIter);
+}
+
+// 自适应马尔可夫链光子追踪，每条链的每一步：
+// 1. 均匀采样一条光子路径，若可见则直接作为新状态（同时用于统计可见路径的比例Vc）；
+// 2. 否则对当前状态做一次变异，变异后的路径可见则接受；
+// 3. 将当前状态的光子记入碰撞点图。链上的光子按均匀采样的能量记录，估算辉度时再乘以Vc
+void Renderer::emitPhotonsAdaptive(int nPhoton, double weight)
+{
+	const int pssSize = (MAX_DEPTH + 2) * Random::PSS_DIMS_PER_BOUNCE;
+	if (m_chains.empty()) m_chains.resize(N_CHAIN);
+	int nStep = (nPhoton + N_CHAIN - 1) / N_CHAIN;
+	double nTotal = double(nStep) * N_CHAIN;
+	double nReference = nTotal / weight;	// 单个光子的能量按参考光子数计算，链上保留的上一轮光子能量仍然有效
+	unsigned long long base = m_nEmitted;
+
+	vector<double> nVisible(N_CHAIN, 0.0);
+	m_scheduler->parallelFor(0, N_CHAIN, 1, [&](long long begin, long long end, int) {
+	for (int c = int(begin); c < end; c++)
+	{
+		MarkovChain &chain = m_chains[c];
+		vector<double> u(pssSize);
+		vector<Photon> landings, records;
+		for (int k = 0; k < nStep; k++)
+		{
+			unsigned long long index = base + (unsigned long long)c * nStep + k;
+
+			// 均匀采样
+			Random uniform(m_seed, Random::PHOTON, index);
+			for (double &x : u) x = uniform.next01();
+			landings.clear();
+			tracePath(u, 2 * index, nReference, landings);
+			if (isVisible(landings))
+			{
+				nVisible[c]++;
+				chain.u = u; chain.landings.swap(landings);
+			} else if (!chain.u.empty())
+			{
+				// 在当前状态附近做对称的均匀扰动（首尾相接），目标分布为0/1，可见即接受
+				Random mutate(m_seed, Random::MUTATE, index);
+				for (int i = 0; i < pssSize; i++)
+				{
+					double x = chain.u[i] + chain.mutationSize * (2 * mutate.next01() - 1);
+					u[i] = x - floor(x);
+				}
+				landings.clear();
+				tracePath(u, 2 * index + 1, nReference, landings);
+				chain.nMutated++;
+				if (isVisible(landings))
+				{
+					chain.nAccepted++;
+					chain.u = u; chain.landings.swap(landings);
+				}
+				chain.mutationSize += (chain.nAccepted / chain.nMutated - 0.234) / chain.nMutated;
+				chain.mutationSize = min(max(chain.mutationSize, 1e-5), 1.0);
+			}
 
-		// 保存图像
-		this->saveImg("update.jpg");
+			// 记录当前状态的光子，攒满一批再写入碰撞点图
+			records.insert(records.end(), chain.landings.begin(), chain.landings.end());
+			if (records.size() >= LANDING_BATCH) { m_hitpointMap->insertPhotons(records); records.clear(); }
+		}
+		m_hitpointMap->insertPhotons(records);
 	}
+	});
+
+	for (int c = 0; c < N_CHAIN; c++) m_nUniformVisible += nVisible[c];
+	m_nUniform += nTotal;
+	m_nEmitted += (unsigned long long)nTotal;
+	m_fluxScale = m_nUniformVisible / m_nUniform;
+	cout << "Visible photon paths: " << m_fluxScale * 100 << "%." << endl;
+}
+
+// 原始样本空间中第0段依次为：选择光源（按能量）、光源上的采样点、发射方向。
+// 每次提议（均匀采样为2 * index，变异为2 * index + 1）各用一个PATH流补足u之外的维度，不同路径不会共用同一组随机数
+void Renderer::tracePath(const vector<double> &u, unsigned long long index, double nTotal, vector<Photon> &landings)
+{
+	Random rng(m_seed, Random::PATH, index);
+	rng.usePSS(u.data(), u.size());
+	rng.bounce(0);
+
+	double totalPower = 0.0;
+	for (Light *light : m_world->lights) totalPower += light->color.power();
+	double target = rng.next01() * totalPower;
+	int l = 0;
+	while (l + 1 < (int)m_world->lights.size() && target >= m_world->lights[l]->color.power())
+		target -= m_world->lights[l++]->color.power();
+	Light *light = m_world->lights[l];
+
+	const ProjectionMap *projMap = m_projMaps[l].empty() ? NULL : &m_projMaps[l];
+	Vec3 ori = light->randomPoint(rng);
+	double weight = 1.0;
+	Vec3 dir = projMap ? projMap->sample(rng, weight) : Vec3::random(rng);
+	Vec3 photonColor = light->color * (totalPower / light->color.power()) / nTotal;
+	Photon photon(ori, dir, photonColor * weight);
+	tracePhoton(photon, 0, rng, &landings);
+}
+
+bool Renderer::isVisible(const vector<Photon> &landings) const
+{
+	for (const Photon &photon : landings)
+		if (m_hitpointMap->visible(photon)) return true;
+	return false;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////
 // PASS1
-// 光线追踪，建立碰撞点图，此步之后m_photo中为RT的结果。传入的dir必须为单位向量
-Vec3 Renderer::traceRay(HitPoint hp, const Vec3 &ori, const Vec3 &dir, int depth)
+// 对第view个相机的每个像素发射光线，碰撞点均标记上所属的视图
+// 设置了裁剪窗口时，只为窗口内的像素建立碰撞点，PASS2的光子也就只在窗口内累计
+void Renderer::rayTrace(int view)
+{
+	// 按TILE * TILE的图块并行，各图块的碰撞点先存入各自的数组，最后按图块顺序合并，结果与线程数无关
+	// 图块按BAND个一组处理，每组合并后即释放，临时数组只占一组的内存
+	const int TILE = 16, BAND = 1024;
+	int height = m_photos[view].height(), width = m_photos[view].width();
+	int nTileH = (height + TILE - 1) / TILE, nTileW = (width + TILE - 1) / TILE, nTile = nTileH * nTileW;
+	for (int first = 0; first < nTile; first += BAND)
+	{
+		int last = min(first + BAND, nTile);
+		vector<vector<HitPoint>> tileHitpoints(last - first), tileBgHitpoints(last - first);
+		m_scheduler->parallelFor(first, last, 1, [&](long long begin, long long end, int) {
+			for (long long t = begin; t < end; t++)
+			{
+				int i0 = int(t / nTileW) * TILE, j0 = int(t % nTileW) * TILE;
+				for (int i = i0; i < min(i0 + TILE, height); i++) for (int j = j0; j < min(j0 + TILE, width); j++)
+					this->tracePixel(view, i, j, tileHitpoints[t - first], tileBgHitpoints[t - first]);
+			}
+		});
+		for (int t = 0; t < last - first; t++)
+		{
+			m_hitpoints.insert(m_hitpoints.end(), tileHitpoints[t].begin(), tileHitpoints[t].end());
+			m_bgHitpoints.insert(m_bgHitpoints.end(), tileBgHitpoints[t].begin(), tileBgHitpoints[t].end());
+		}
+	}
+}
+
+// 对第view个视图的像素(i, j)做光线追踪
+void Renderer::tracePixel(int view, int i, int j, vector<HitPoint> &hitpoints, vector<HitPoint> &bgHitpoints)
+{
+	Camera *camera = m_world->cameras[view];
+	Color pixel;
+	Random rng(m_seed, Random::CAMERA, (((unsigned long long)view << 20) + i) << 20 | j);
+	double h, w;	// 输出像素(i, j)对应的屏幕坐标，预览时一个像素覆盖1/m_scale个原像素
+	camera->pixelToScreen((i + 0.5) / m_scale - 0.5, (j + 0.5) / m_scale - 0.5, h, w);
+	double h1, w1;	// 下一行像素的屏幕坐标，两者光线方向之差即为一个像素所张的角
+	camera->pixelToScreen((i + 1.5) / m_scale - 0.5, (j + 0.5) / m_scale - 0.5, h1, w1);
+	double cone = (camera->ray(h1, w1) - camera->ray(h, w)).length();
+	HitPoint hp(i, j, Vec3(1.0, 1.0, 1.0), view);
+	// 有景深效果，则增加随机采样环节
+	if (camera->aperture > EPSILON)
+	{
+		int nSample = camera->nSample;
+		hp.weight /= nSample;
+		for (int k = 0; k < nSample; k++)
+		{
+			rng.bounce(k);
+			auto ray = camera->rayAperture(h, w, rng);
+			Vec3 apertOri = ray.first, apertDir = ray.second;
+			pixel += traceRay(hp, apertOri, apertDir, 0, hitpoints, bgHitpoints, cone);
+		}
+		pixel /= nSample;
+	} else	// 否则无景深，纯RT
+	{
+		Vec3 ori = camera->C;
+		Vec3 dir = camera->ray(h, w);
+		pixel = traceRay(hp, ori, dir, 0, hitpoints, bgHitpoints, cone);
+	}
+	m_photos[view].set(i, j, pixel);
+}
+
+// 光线追踪，建立碰撞点图，此步之后m_photos中为RT的结果。传入的dir必须为单位向量
+Vec3 Renderer::traceRay(HitPoint hp, const Vec3 &ori, const Vec3 &dir, int depth,
+						 vector<HitPoint> &hitpoints, vector<HitPoint> &bgHitpoints, double cone)
 {
 	// 递归基：超过最大递归深度
-	if (depth > MAX_DEPTH) { m_bgHitpoints.push_back(hp); return m_world->bgColor; }
+	if (depth > MAX_DEPTH) { bgHitpoints.push_back(hp); return m_world->bgColor; }
 
 	// 寻找最近的相交物体，并获取法向量、碰撞位置、碰撞位置的颜色（与纹理有关）
 	double maxDist = INT_MAX;
@@ -114,11 +824,11 @@ Vec3 Renderer::traceRay(HitPoint hp, const Vec3 &ori, const Vec3 &dir, int depth
 	Vec3 P, N, objectColor;	// 碰撞位置、法向量、颜色
 	Intersection intersection = MISS, temp = MISS;
 	for (Object *object : m_world->objects)
-		if ((temp = object->intersect(ori, dir, maxDist, &P, &N, &objectColor)))
+		if ((temp = object->intersect(ori, dir, maxDist, &P, &N, &objectColor, cone)))
 			nearestObject = object, intersection = temp;
 
 	// 递归基：无碰撞
-	if (!nearestObject) { m_bgHitpoints.push_back(hp); return m_world->bgColor; }
+	if (!nearestObject) { bgHitpoints.push_back(hp); return m_world->bgColor; }
 
 	// 分别计算漫反射&高光（Phong模型）、镜面反射、折射
 	Vec3 ret(0, 0, 0);
@@ -129,8 +839,8 @@ Vec3 Renderer::traceRay(HitPoint hp, const Vec3 &ori, const Vec3 &dir, int depth
 		HitPoint hpDiff = hp;
 		hpDiff.object = nearestObject; hpDiff.P = P; hpDiff.N = N;
 		hpDiff.weight *= objectColor * nearestObject->diff;
-		hpDiff.radius2 = INIT_RADIUS * INIT_RADIUS;
-		m_hitpoints.push_back(hpDiff);
+		hpDiff.radius2 = m_radius * m_radius;
+		hitpoints.push_back(hpDiff);
 
 		// 计算Phong模型
 		for (Light *light : m_world->lights)
@@ -156,7 +866,7 @@ Vec3 Renderer::traceRay(HitPoint hp, const Vec3 &ori, const Vec3 &dir, int depth
 	{
 		HitPoint hpRefl = hp;
 		hpRefl.weight *= objectColor * nearestObject->refl;
-		ret += traceRay(hpRefl, P, dir.reflected(N), depth + 1) * nearestObject->refl * objectColor;
+		ret += traceRay(hpRefl, P, dir.reflected(N), depth + 1, hitpoints, bgHitpoints) * nearestObject->refl * objectColor;
 	}
 	//////////////////////////////////////////////////////////////// 折射
 	if (nearestObject->refr > EPSILON)
@@ -165,7 +875,7 @@ Vec3 Renderer::traceRay(HitPoint hp, const Vec3 &ori, const Vec3 &dir, int depth
 		hpRefr.weight *= objectColor * nearestObject->refr;
 		double n = (intersection == INSIDE) ? nearestObject->ior : (1 / nearestObject->ior);
 		Vec3 refracted = dir.refracted((intersection == INSIDE ? -N : N), n);
-		ret += traceRay(hpRefr, P, refracted, depth + 1) * nearestObject->refr * objectColor;
+		ret += traceRay(hpRefr, P, refracted, depth + 1, hitpoints, bgHitpoints) * nearestObject->refr * objectColor;
 	}
 	return ret;
 }
@@ -174,7 +884,7 @@ Vec3 Renderer::traceRay(HitPoint hp, const Vec3 &ori, const Vec3 &dir, int depth
 ///////////////////////////////////////////////////////////////////////////////
 // PASS2
 // 光子发射，让光子纷纷扬扬地洒向场景~~~~美哉幻哉，美哉幻哉
-void Renderer::tracePhoton(Photon &photon, int depth)
+void Renderer::tracePhoton(Photon &photon, int depth, Random &rng, vector<Photon> *landings)
 {
 	// 递归基：超过最大追踪深度
 	if (depth > MAX_DEPTH) return;
@@ -195,85 +905,375 @@ void Renderer::tracePhoton(Photon &photon, int depth)
 	photon.P = P; photon.object = nearestObject;
 
 	// 如果是漫反射表面，查询该光子在哪些碰撞点的内部，存入kdMap中
-	if (nearestObject->diff > EPSILON) m_kdMap.insertPhoton(photon);
+	if (nearestObject->diff > EPSILON)
+	{
+		if (landings) landings->push_back(photon);
+		else m_hitpointMap->insertPhoton(photon);
+	}
 
 	// 准备发射新光子
 	Photon newPhoton = photon;
 	newPhoton.color *= objectColor; newPhoton.ori = P;
 
-	// 轮盘赌
-	double estimater = rand01();
+	// 轮盘赌，第depth次弹射使用随机数段depth + 1（段0用于光子发射）
+	rng.bounce(depth + 1);
+	double estimater = rng.next01();
 	double mark1 = nearestObject->diff + nearestObject->spec,
 		   mark2 = mark1 + nearestObject->refl,
 		   mark3 = mark2 + nearestObject->refr;
 	if (estimater < mark1)	// diff + spec
 	{
-		newPhoton.dir = Vec3::randomCosine(N);
-		tracePhoton(newPhoton, depth + 1);
+		newPhoton.dir = Vec3::randomCosine(N, rng);
+		tracePhoton(newPhoton, depth + 1, rng, landings);
 	} else if (estimater < mark2)	// refl
 	{
 		newPhoton.dir = photon.dir.reflected(N);
-		tracePhoton(newPhoton, depth + 1);
+		tracePhoton(newPhoton, depth + 1, rng, landings);
 	} else // refr
 	{
 		double n = (intersection == INSIDE) ? nearestObject->ior : (1 / nearestObject->ior);
 		newPhoton.dir = photon.dir.refracted((intersection == INSIDE) ? -N : N, n);
-		tracePhoton(newPhoton, depth + 1);
+		tracePhoton(newPhoton, depth + 1, rng, landings);
+	}
+}
+
+// 波前式光子追踪：与tracePhoton逐个深度优先追踪不同，一个波前内的所有光子按弹射次数逐级推进，每级分为三个阶段：
+// 1. 求交：以物体为外层循环，同一种图元的求交代码连续执行；
+// 2. 按物体（即材质）计数排序，漫反射表面的落点集中批量写入碰撞点图；
+// 3. 散射：同一材质的光子连续做轮盘赌、生成新方向。
+// 每个光子第depth次弹射的随机数取自其随机数段depth + 1，与弹射顺序无关，因此结果与tracePhoton完全一致
+void Renderer::traceWavefront(vector<PhotonState> &wave)
+{
+	const vector<Object*> &objects = m_world->objects;
+	int nObject = objects.size();
+	vector<PhotonState> sorted;
+	vector<Photon> landings;
+	vector<int> count(nObject + 1);
+	for (int depth = 0; depth <= MAX_DEPTH && !wave.empty(); depth++)
+	{
+		// 求交阶段
+		for (PhotonState &state : wave) { state.maxDist = INT_MAX; state.object = -1; }
+		for (int k = 0; k < nObject; k++)
+		{
+			const Object *object = objects[k];
+			for (PhotonState &state : wave)
+			{
+				Intersection temp = object->intersect(state.ori, state.dir, state.maxDist, &state.P, &state.N, &state.objectColor);
+				if (temp) state.object = k, state.intersection = temp;
+			}
+		}
+
+		// 排序阶段：丢弃无碰撞的光子，其余按物体编号计数排序
+		fill(count.begin(), count.end(), 0);
+		for (const PhotonState &state : wave) if (state.object >= 0) count[state.object + 1]++;
+		for (int k = 0; k < nObject; k++) count[k + 1] += count[k];
+		sorted.resize(count[nObject]);
+		for (const PhotonState &state : wave) if (state.object >= 0) sorted[count[state.object]++] = state;
+		wave.swap(sorted);
+
+		// 批量写入漫反射表面上的落点
+		landings.clear();
+		for (const PhotonState &state : wave)
+		{
+			Object *object = objects[state.object];
+			if (object->diff <= EPSILON) continue;
+			Photon photon(state.ori, state.dir, state.color);
+			photon.P = state.P; photon.object = object;
+			landings.push_back(photon);
+		}
+		m_hitpointMap->insertPhotons(landings);
+
+		// 散射阶段
+		for (PhotonState &state : wave)
+		{
+			const Object *object = objects[state.object];
+			Random rng(m_seed, Random::PHOTON, state.index, m_qmc);
+			rng.bounce(depth + 1);
+			double estimater = rng.next01();
+			double mark1 = object->diff + object->spec,
+				   mark2 = mark1 + object->refl;
+			Vec3 dir;
+			if (estimater < mark1)	// diff + spec
+				dir = Vec3::randomCosine(state.N, rng);
+			else if (estimater < mark2)	// refl
+				dir = state.dir.reflected(state.N);
+			else	// refr
+			{
+				double n = (state.intersection == INSIDE) ? object->ior : (1 / object->ior);
+				dir = state.dir.refracted((state.intersection == INSIDE) ? -state.N : state.N, n);
+			}
+			state.color *= state.objectColor; state.ori = state.P; state.dir = dir;
+		}
 	}
 }
 
+// 本轮发射的光子数：未设置目标时间时为参考光子数nPhoton；
+// 否则按测得的光子吞吐量与每轮的固定开销（更新碰撞点图、等待输出等），使一轮的墙钟时间接近目标时间
+int Renderer::batchSize(int nPhoton) const
+{
+	if (m_targetTime <= 0) return nPhoton;
+	int minBatch = PHOTON_GRAIN * m_scheduler->size();
+	double nBatch = (m_photonRate > 0) ? (m_targetTime - m_iterOverhead) * m_photonRate : minBatch;
+	nBatch = min(max(nBatch, double(minBatch)), 16.0 * nPhoton);
+	if (m_adaptive) nBatch = ceil(nBatch / N_CHAIN) * N_CHAIN;	// 自适应模式下每条链的步数相同
+	return int(nBatch);
+}
+
+// 记录一轮的用时：emitTime为发射nBatch个光子的用时，iterTime为整轮的用时，均取指数滑动平均
+void Renderer::measureBatch(int nBatch, double emitTime, double iterTime)
+{
+	if (m_targetTime <= 0) return;
+	const double SMOOTH = 0.5;
+	double rate = nBatch / max(emitTime, 1e-6), overhead = max(iterTime - emitTime, 0.0);
+	m_photonRate = (m_photonRate > 0) ? SMOOTH * m_photonRate + (1 - SMOOTH) * rate : rate;
+	m_iterOverhead = SMOOTH * m_iterOverhead + (1 - SMOOTH) * overhead;
+	cout << "Batch: " << nBatch << " photons, " << iterTime << "s." << endl;
+}
+
+// 是否应停止渲染：收到停止请求，或剩余的时间预算不足nextIterTime秒（下一轮的预计用时）
+bool Renderer::outOfBudget(double nextIterTime) const
+{
+	if (m_stop) return true;
+	if (m_timeBudget <= 0) return false;
+	double elapsed = chrono::duration<double>(chrono::steady_clock::now() - m_renderStart).count();
+	return elapsed + nextIterTime > m_timeBudget;
+}
+
+// 估算各像素的相对误差：碰撞点i处的辉度c_i由n_i个光子估算，相对误差约为1/sqrt(n_i)，
+// 像素的相对误差为sqrt(Σ c_i^2 / n_i) / Σ c_i。所有收到过光的像素都不超过噪声目标时返回true；
+// 开启focus时，已收敛像素的碰撞点被冻结，此后的光子只累计到未收敛的区域
+bool Renderer::checkConvergence(double nIter, double fluxScale)
+{
+	int nHitpoint = 0;
+	HitPoint *hitpoints = m_hitpointMap->data(nHitpoint);
+	int nView = m_photos.size();
+	vector<vector<double>> sum(nView), var(nView);
+	for (int v = 0; v < nView; v++)
+	{
+		size_t nPixel = size_t(m_photos[v].height()) * m_photos[v].width();
+		sum[v].assign(nPixel, 0.0); var[v].assign(nPixel, 0.0);
+	}
+	for (int i = 0; i < nHitpoint; i++)
+	{
+		const HitPoint &hp = hitpoints[i];
+		double nPhoton = hp.nAccum + hp.nNew;
+		if (nPhoton <= 0) continue;
+		double n = (hp.frozen() ? hp.iter1 : nIter) - hp.iter0;
+		double c = (hp.weight * hp.phi).power() * fluxScale / (hp.radius2 * n);
+		size_t pixel = size_t(hp.row) * m_photos[hp.view].width() + hp.col;
+		sum[hp.view][pixel] += c;
+		var[hp.view][pixel] += c * c / nPhoton;
+	}
+
+	// 统计未收敛的像素（没有收到光的像素不计）
+	long long nLit = 0, nUnconverged = 0;
+	vector<vector<bool>> converged(nView);
+	for (int v = 0; v < nView; v++)
+	{
+		converged[v].assign(sum[v].size(), false);
+		for (size_t p = 0; p < sum[v].size(); p++)
+		{
+			if (sum[v][p] <= 0) continue;
+			nLit++;
+			converged[v][p] = sqrt(var[v][p]) <= m_noiseTarget * sum[v][p];
+			if (!converged[v][p]) nUnconverged++;
+		}
+	}
+	cout << "Unconverged pixels: " << nUnconverged << " / " << nLit << endl;
+
+	if (m_focus && !m_adaptive)	// 自适应模式的可见性归一化要求可见的碰撞点集合不变，不冻结
+	{
+		for (int i = 0; i < nHitpoint; i++)
+		{
+			HitPoint &hp = hitpoints[i];
+			if (!hp.frozen() && converged[hp.view][size_t(hp.row) * m_photos[hp.view].width() + hp.col])
+			{
+				hp.iter1 = nIter;
+				m_touched.push_back(i);
+			}
+		}
+		m_hitpointMap->updateBox(m_scheduler);
+	}
+	return nLit > 0 && nUnconverged == 0;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////
 // 更新碰撞点图
 void Renderer::updateKDMap()
 {
 	int nHitpoint = 0;
-	HitPoint *hitpoints = m_kdMap.data(/*&*/nHitpoint);
+	HitPoint *hitpoints = m_hitpointMap->data(/*&*/nHitpoint);
 
-	for (int i = 0; i < nHitpoint; i++) hitpoints[i].update(ALPHA);
-	m_kdMap.update();
+	// 先合并本轮各线程累加的光通量，再更新各碰撞点的半径；各块分别记录光通量或半径变化了的、半径变化了的碰撞点，按块的顺序合并
+	const int CHUNK = 4096;
+	int nChunk = (nHitpoint + CHUNK - 1) / CHUNK;
+	vector<vector<int>> chunkTouched(nChunk), chunkDirty(nChunk);
+	m_scheduler->parallelFor(0, nChunk, 1, [&](long long first, long long last, int) {
+		for (long long c = first; c < last; c++)
+		{
+			int begin = int(c) * CHUNK, end = min(begin + CHUNK, nHitpoint);
+			vector<int> &touched = chunkTouched[c];
+			m_hitpointMap->flush(begin, end, &touched);
+			size_t nFlushed = touched.size(), k = 0;
+			for (int i = begin; i < end; i++)
+			{
+				bool flushed = (k < nFlushed && touched[k] == i);
+				if (flushed) k++;
+				double radius2 = hitpoints[i].radius2;
+				hitpoints[i].update(ALPHA);
+				if (hitpoints[i].radius2 == radius2) continue;
+				chunkDirty[c].push_back(i);
+				if (!flushed) touched.push_back(i);	// 继承而来的光子统计量可能在没有新光子时也更新
+			}
+		}
+	});
+	vector<int> dirty;
+	for (int c = 0; c < nChunk; c++)
+	{
+		m_touched.insert(m_touched.end(), chunkTouched[c].begin(), chunkTouched[c].end());
+		dirty.insert(dirty.end(), chunkDirty[c].begin(), chunkDirty[c].end());
+	}
+	m_hitpointMap->update(dirty, m_scheduler);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////
 // 估算辉度
-void Renderer::evalIrradiance(int nIter)
+// 按像素对碰撞点分组（计数排序，同一像素内保持原顺序），并预先累加背景色；此后第一次估算重算所有像素
+void Renderer::buildEvalCache()
 {
-	// 将光线追踪的颜色值清零
-	int height = m_world->camera->height, width = m_world->camera->width;
-	for (int i = 0; i < height; i++) for (int j = 0; j < width; j++) m_photo[i][j] = Vec3(0, 0, 0);
+	int nHitpoint = 0;
+	const HitPoint *hitpoints = m_hitpointMap->data(nHitpoint);
+	int nView = m_photos.size();
+	m_viewBase.assign(nView + 1, 0);
+	for (int v = 0; v < nView; v++) m_viewBase[v + 1] = m_viewBase[v] + m_photos[v].height() * m_photos[v].width();
+	int nPixel = m_viewBase[nView];
 
-	// 估算辉度
+	m_pixelStart.assign(nPixel + 1, 0);
+	for (int i = 0; i < nHitpoint; i++) m_pixelStart[pixelOf(hitpoints[i]) + 1]++;
+	for (int p = 0; p < nPixel; p++) m_pixelStart[p + 1] += m_pixelStart[p];
+	vector<int, MappedAllocator<int>> fill(m_pixelStart.begin(), m_pixelStart.end() - 1);
+	m_slotOf.resize(nHitpoint);
+	for (int i = 0; i < nHitpoint; i++) m_slotOf[i] = fill[pixelOf(hitpoints[i])]++;
+	m_terms.assign(nHitpoint, EvalTerm());
+
+	m_static.assign(nPixel, Color(0, 0, 0));
+	Vec3 bgColor = m_world->bgColor;
+	for (const HitPoint &hp : m_bgHitpoints) m_static[pixelOf(hp)] += bgColor * hp.weight;
+	m_live.assign(nPixel, 1);
+	m_touched.clear();
+	m_touchAll = true;
+	m_evalReady = true;
+}
+
+void Renderer::evalIrradiance(double nIter, double fluxScale)
+{
+	if (!m_evalReady) this->buildEvalCache();
 	int nHitpoint = 0;
-	HitPoint *hitpoints = m_kdMap.data(/*&*/nHitpoint);
-	for (int i = 0; i < nHitpoint; i++)
+	const HitPoint *hitpoints = m_hitpointMap->data(/*&*/nHitpoint);
+	double k = 10000.0 * fluxScale;
+
+	// 刷新变化了的碰撞点的贡献，各块分别记录涉及的像素
+	const int CHUNK = 4096;
+	long long nTouched = m_touchAll ? nHitpoint : m_touched.size();
+	int nChunk = int((nTouched + CHUNK - 1) / CHUNK);
+	vector<vector<int>> chunkPixels(nChunk);
+	m_scheduler->parallelFor(0, nChunk, 1, [&](long long first, long long last, int) {
+		for (long long c = first; c < last; c++)
+			for (long long t = c * CHUNK; t < min(nTouched, (c + 1) * CHUNK); t++)
+			{
+				int i = m_touchAll ? int(t) : m_touched[t];
+				const HitPoint &hp = hitpoints[i];
+				EvalTerm &term = m_terms[m_slotOf[i]];
+				if (term.folded) continue;
+				term.term = hp.weight * hp.phi / hp.radius2;
+				term.iter0 = hp.iter0; term.iter1 = hp.iter1;
+				chunkPixels[c].push_back(pixelOf(hp));
+			}
+	});
+	for (const vector<int> &pixels : chunkPixels) for (int p : pixels) m_live[p] = 1;
+	m_touched.clear();
+	m_touchAll = false;
+
+	// 按像素并行重算：新冻结的碰撞点（只计入冻结之前的轮数）转入静态部分，其余按当前轮数归一化
+	vector<int> livePixels;
+	for (int p = 0; p < (int)m_live.size(); p++) if (m_live[p]) livePixels.push_back(p);
+	m_scheduler->parallelFor(0, livePixels.size(), 1024, [&](long long begin, long long end, int) {
+		int v = int(upper_bound(m_viewBase.begin(), m_viewBase.end(), livePixels[begin]) - m_viewBase.begin()) - 1;
+		for (long long j = begin; j < end; j++)
+		{
+			int p = livePixels[j];
+			while (p >= m_viewBase[v + 1]) v++;
+			Color sum(0, 0, 0);
+			bool live = false;
+			for (int s = m_pixelStart[p]; s < m_pixelStart[p + 1]; s++)
+			{
+				EvalTerm &term = m_terms[s];
+				if (term.folded) continue;
+				if (term.iter1 >= 0)
+				{
+					m_static[p] += k * term.term / (term.iter1 - term.iter0);
+					term.folded = true;
+				} else if (term.term.power() > 0)
+				{
+					sum += k * term.term / (nIter - term.iter0);
+					live = true;
+				}
+			}
+			m_live[p] = live;
+			int width = m_photos[v].width(), q = p - m_viewBase[v];
+			m_photos[v].set(q / width, q % width, m_static[p] + sum);
+		}
+	});
+}
+
+// 概率渐进式光子映射的辉度估算：各碰撞点处nIter轮估计值的平均
+void Renderer::evalProbabilistic(int nIter)
+{
+	for (Framebuffer &photo : m_photos) photo.clear();
+
+	for (int i = 0; i < (int)m_hitpoints.size(); i++)
 	{
-		HitPoint hp = hitpoints[i];
-		Vec3 irradiance = 10000.0 * hp.phi / (hp.radius2 * nIter);
-		m_photo[hp.row][hp.col] += irradiance * hp.weight;
+		const HitPoint &hp = m_hitpoints[i];
+		m_photos[hp.view].add(hp.row, hp.col, m_pppmSum[i] / nIter * hp.weight);
 	}
 
 	// 计入背景色
 	Vec3 bgColor = m_world->bgColor;
-	for (int i = 0; i < m_bgHitpoints.size(); i++)
-	{
-		HitPoint hp = m_bgHitpoints[i];
-		m_photo[hp.row][hp.col] += bgColor * hp.weight;
-	}
+	for (const HitPoint &hp : m_bgHitpoints)
+		m_photos[hp.view].add(hp.row, hp.col, bgColor * hp.weight);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////
-// 保存图片
-void Renderer::saveImg(const string &fileName)
+// 保存图片：第0个视图保存为fileName，其余视图在扩展名前加上"_视图编号"
+void Renderer::saveImg(const string &fileName, double exposure)
 {
-	cv::Mat_<cv::Vec3b> img;
-	int height = m_world->camera->height, width = m_world->camera->width;
-	img.create(height, width);
-
-	for (int i = 0; i < height; i++) for (int j = 0; j < width; j++)
-		for (int k = 0; k < 3; k++)
-			img(i, j)[k] = min(m_photo[i][j][2 - k], 1.0) * 255;
+	for (int v = 0; v < (int)m_photos.size(); v++)
+	{
+		string viewName = fileName;
+		if (v > 0)
+		{
+			size_t dot = fileName.rfind('.');
+			if (dot == string::npos) dot = fileName.size();
+			viewName = fileName.substr(0, dot) + "_" + to_string(v) + fileName.substr(dot);
+		}
+		this->saveImg(viewName, v, exposure);
+	}
+}
 
-	cv::imwrite(fileName, img);
+void Renderer::saveImg(const string &fileName, int view, double exposure)
+{
+	// 裁剪渲染时，另存一份取景信息，记录窗口在整张照片中的位置
+	const Camera *camera = m_world->cameras[view];
+	ostringstream sidecar;
+	if (camera->cropped())
+	{
+		sidecar << "frame " << camera->height << ' ' << camera->width << endl;
+		sidecar << "crop " << camera->cropH << ' ' << camera->cropW << ' '
+				<< camera->cropHeight << ' ' << camera->cropWidth << endl;
+		sidecar << "zoom " << camera->zoom << endl;
+	}
+	m_writer.submit(fileName, m_photos[view], exposure, sidecar.str());
 }
\ No newline at end of file
@@ -3,9 +3,21 @@
 
 #include "../Object.h"
 #include "utils.h"
+#include "HashGridMap.h"
+#include "ProjectionMap.h"
+#include "Scheduler.h"
+#include "SharedState.h"
+#include "ImageWriter.h"
+#include "PreviewChannel.h"
+#include "../Random.h"
 #include <vector>
+#include <future>
+#include <atomic>
+#include <chrono>
 
 class World;
+// 碰撞点数组，开启超大图像模式时存放在映射内存中
+typedef std::vector<HitPoint, MappedAllocator<HitPoint>> HitPointArray;
 /**
 渲染器类Renderer，负责实现光线追踪、渐进式光子映射算法
 */
@@ -15,32 +27,238 @@ public:
 	const static int MAX_DEPTH = 8;	// 光线追踪、光子映射的最大深度
 	const static int MAX_PPM_ITER = 100000;	// PPM最大迭代次数
 	const static int MAX_PHOTON_NUM = 5000000;	// 最大发射光子数
+	const static int PHOTON_GRAIN = 1024;	// 调度器中每个任务块的光子数
+	const static int PPPM_PHOTON_NUM = 500000;	// 概率渐进式光子映射每轮迭代的光子数
+	const static int WAVEFRONT_SIZE = 8192;	// 波前模式下每个波前（任务块）的光子数
+	const static int LANDING_BATCH = 65536;	// 每个线程缓存的光子落点数，攒满后排序、批量写入碰撞点图
 	const double INIT_RADIUS;	// 各个碰撞点初始半径
 	const double ALPHA;	// 论文中的系数α，决定半径衰减速率
 
 public:
-	Renderer() : INIT_RADIUS(2), ALPHA(0.5) {}	// 调参，场景大小为200左右时较为合适
-	~Renderer() {}
+	Renderer() : INIT_RADIUS(2), ALPHA(0.5),	// 调参，场景大小为200左右时较为合适
+		m_hitpointMap(NULL), m_hashGrid(false), m_outOfCore(false), m_residentLimit(0),
+		m_nPreviewLevel(0), m_nPreviewIter(2), m_scale(1.0), m_radius(INIT_RADIUS),
+		m_seed(0), m_nEmitted(0), m_useQMC(false), m_qmc(NULL), m_useProjMap(false),
+		m_adaptive(false), m_nUniform(0), m_nUniformVisible(0), m_fluxScale(1.0),
+		m_evalReady(false), m_touchAll(false), m_scheduler(NULL), m_nThread(0), m_pin(false), m_wavefront(false), m_probabilistic(false), m_pppmMemory(size_t(1) << 30),
+		m_targetTime(0), m_photonRate(0), m_iterOverhead(0),
+		m_timeBudget(0), m_noiseTarget(0), m_focus(false), m_stop(false),
+		m_checkpointInterval(600) {}
+	~Renderer() { finishOutput(); delete m_qmc; delete m_scheduler; delete m_hitpointMap; }
+
+	// 设置工作线程数（0为全部逻辑核），pin为true时将线程绑定到各个核上；须在render之前调用
+	void setThreads(int nThread, bool pin = false) { m_nThread = nThread; m_pin = pin; }
+	// 选择碰撞点图：false为KD树（KDMap），true为哈希网格（HashGridMap），两者结果相同，速度因场景而异
+	void setHashGrid(bool hashGrid) { m_hashGrid = hashGrid; }
+	// 开启超大图像模式：碰撞点、KD树等大数组改为映射dir下的临时文件，图像大小不再受物理内存限制，内存不足时只是变慢；
+	// 碰撞点按空间顺序（Morton码）存放，映射的总量超过residentLimit字节时，每轮迭代结束后把常驻页交还操作系统；
+	// residentLimit为0时从不主动交还，完全由操作系统按内存压力换页。dir为空串时关闭
+	void setOutOfCore(const std::string &dir, size_t residentLimit = 0) {
+		MappedMemory::setDirectory(dir);
+		m_outOfCore = !dir.empty(); m_residentLimit = residentLimit;
+	}
+	// 设置随机数种子，同一种子在任意线程数下渲染出完全相同的图像
+	void setSeed(unsigned long long seed) { m_seed = seed; }
+	// 开启拟蒙特卡洛光子发射：发射方向及前几次弹射改用按光子全局编号取样的加扰Halton序列
+	void setQMC(bool useQMC) { m_useQMC = useQMC; }
+	// 开启投影图：点光源只向能打中物体的方向发射光子，并向镜面物体（焦散来源）多发射光子
+	void setProjectionMap(bool useProjMap) { m_useProjMap = useProjMap; }
+	// 开启自适应马尔可夫链光子追踪：以“光子至少落入一个可见碰撞点”为目标，在原始样本空间中变异光子路径，
+	// 并用均匀采样估计的可见路径比例归一化（Hachisuka & Jensen 2011），适用于光源被遮挡、焦散难以到达的场景
+	void setAdaptive(bool adaptive) { m_adaptive = adaptive; }
+	// 开启波前式光子追踪：光子成批地分阶段求交、按材质排序散射、批量写入碰撞点图，提高单核吞吐量，结果与逐个追踪相同
+	// 自适应模式下不起作用
+	void setWavefront(bool wavefront) { m_wavefront = wavefront; }
+	// 开启概率渐进式光子映射（PPPM）：每轮迭代独立建立光子图，以全局缩小的半径在碰撞点处收集光子，图像取各轮平均；
+	// 各轮互不依赖，可以同时进行多轮；同时进行的各轮光子图总共不超过memoryBudget字节。自适应模式、波前模式下不起作用
+	void setProbabilistic(bool probabilistic, size_t memoryBudget = size_t(1) << 30) {
+		m_probabilistic = probabilistic; m_pppmMemory = memoryBudget;
+	}
+	// 设置每轮迭代的目标墙钟时间（秒），每轮的光子数随测得的吞吐量自动调整；为0时每轮固定发射MAX_PHOTON_NUM个光子
+	// 光子能量固定，发射n个光子记为n / MAX_PHOTON_NUM轮，因此各轮光子数不同时辉度估算仍然一致
+	void setTargetTime(double seconds) { m_targetTime = seconds; }
+	// 设置渲染预算：用时达到seconds秒，或所有像素的相对误差都不超过noise时停止，先到者为准；为0表示不限。
+	// 每轮结束时都已输出当前最好的图像，停止时不会丢失结果；预览会为全分辨率的PASS1与一轮迭代留出预计的时间，
+	// 预算在全分辨率开始前已用完时，交付最后一级预览的图像。focus为true时冻结已收敛像素的碰撞点，光子只累计到未收敛的区域（自适应模式下不冻结）
+	void setBudget(double seconds, double noise = 0, bool focus = false) { m_timeBudget = seconds; m_noiseTarget = noise; m_focus = focus; }
+	// 请求在本轮结束后停止渲染（线程安全，可在信号处理函数中调用）
+	void requestStop() { m_stop = true; }
+	// 开启断点续渲：全分辨率迭代期间每隔interval秒，在一轮结束时把渐进式光子映射的全部状态写入检查点文件path
+	// （后台写临时文件，写完后原子替换），渲染结束或停止时再写一次。渲染开始时若path处已有与当前场景、种子相符的检查点，
+	// 则跳过光线追踪与预览，从检查点的迭代轮次继续。每轮光子数固定且不用自适应模式时，续渲的图像与不中断渲染的完全相同；
+	// 按目标时间调整光子数时各轮的光子数取决于实测用时，自适应模式下马尔可夫链会重新开始，续渲结果只在统计意义上等价。
+	// 概率渐进式模式与多进程模式下不起作用
+	void setCheckpoint(const std::string &path, double interval = 600) { m_checkpointPath = path; m_checkpointInterval = interval; }
+	// 开启快速预览：先以1/2^nLevel的分辨率渲染，每级迭代nIterPerLevel轮后分辨率翻倍，直至全分辨率
+	void setPreview(int nLevel, int nIterPerLevel = 2) { m_nPreviewLevel = nLevel; m_nPreviewIter = nIterPerLevel; }
+	// 开启实时预览通道：每轮的图像与迭代轮数、光子吞吐量等统计量由后台输出线程发布到内存映射文件path
+	// （如Linux下的"/dev/shm/ppm_preview"），查看程序用PreviewChannel::open、read按自己的节奏读取。path为空串时关闭
+	void setPreviewChannel(const std::string &path) { m_channelPath = path; }
 
 	// 主要接口，渲染顶层调用
 	void render(World *world);	
+	// 多进程渲染：协调进程完成PASS1并合并各工作进程的结果，工作进程只发射光子，两者通过共享文件path交换数据；
+	// 超过timeout秒未报告的工作进程本轮不计入，因而工作进程崩溃不影响渲染
+	void renderCoordinator(World *world, const std::string &path, int nWorker, double timeout = 60);
+	void renderWorker(World *world, const std::string &path, int worker);
 	// PASS1：光线追踪，建立碰撞点图（调试时，将PASS2以下的代码全部注释掉，即得纯RT）
-	Color traceRay(HitPoint hp, const Vec3 &ori, const Vec3 &dir, int depth);
+	// 新的碰撞点存入hitpoints，打到背景的碰撞点存入bgHitpoints，以便多线程各自输出
+	// cone为一个像素所张的角（光线足迹宽度随距离的增量），只用于从相机出发的光线选择纹理的mipmap层级，反射、折射光线取原图
+	Color traceRay(HitPoint hp, const Vec3 &ori, const Vec3 &dir, int depth,
+				   std::vector<HitPoint> &hitpoints, std::vector<HitPoint> &bgHitpoints, double cone = 0);
 	// PASS2：光子发射，查询、更新碰撞点图
-	void tracePhoton(Photon &photon, int depth);
-	// 将渲染好的图片存入文件（每发射一轮光子就保存一次）
-	void saveImg(const std::string &fileName);
+	// 给定landings时只记录光子在漫反射表面上的落点，不写入碰撞点图
+	void tracePhoton(Photon &photon, int depth, Random &rng, std::vector<Photon> *landings = NULL);
+	// 将渲染好的图片存入文件（每发射一轮光子就保存一次），多视图时每个视图各存一张；
+	// 只提交当前图像的快照，由后台线程写盘，exposure为曝光倍数，.pfm格式保存完整的动态范围
+	void saveImg(const std::string &fileName, double exposure = 1.0);
+	void saveImg(const std::string &fileName, int view, double exposure);
+	// 等待已提交的图像全部写完，程序退出前调用
+	void flushImages() { m_writer.flush(); }
 
 private:
+
+	// 内部接口：渲染前的准备
+	void prepare(World *world);
+	// 内部接口：以scale的分辨率对所有视图做光线追踪，并从上一级分辨率的碰撞点继承光子统计量
+	void rayTracePass(double scale, double nIter);
+	void inheritHitpoints(const HitPointArray &coarse, double coarseScale);
+	// 内部接口：对第view个相机做光线追踪，生成该视图的碰撞点
+	void rayTrace(int view);
+	void tracePixel(int view, int i, int j, std::vector<HitPoint> &hitpoints, std::vector<HitPoint> &bgHitpoints);
+	// 内部接口：按能量将nPhoton个光子分配给各个光源；从第l个光源发射一个光子
+	void lightPhotons(int nPhoton, std::vector<long long> &offset, std::vector<Color> &photonColor, double weight = 1.0) const;
+	Photon emitPhoton(int l, const Color &color, Random &rng) const;
+	// 内部接口：渲染预算是否已不够再迭代一轮；估算各像素的误差，判断是否已收敛
+	bool outOfBudget(double nextIterTime) const;
+	bool checkConvergence(double nIter, double fluxScale);
+	// 内部接口：本轮的光子数、记录本轮的用时
+	int batchSize(int nPhoton) const;
+	void measureBatch(int nBatch, double emitTime, double iterTime);
+	// 内部接口：发射一轮光子（共nPhoton个），所有光子的能量之和为光源总能量的weight倍
+	void emitPhotons(int nPhoton, double weight = 1.0);
+	// 波前中单个光子的追踪状态
+	struct PhotonState
+	{
+		Vec3 ori, dir;		// 本段路径的始点、方向
+		Color color;		// 光子能量
+		Vec3 P, N;			// 求交阶段得到的碰撞位置、法向量
+		Color objectColor;	// 碰撞位置的颜色
+		double maxDist;		// 求交阶段当前的最近距离
+		unsigned long long index;	// 光子的全局编号，决定其随机数
+		int object;			// 被碰撞物体的编号，-1为无碰撞
+		Intersection intersection;
+		PhotonState() {}
+		PhotonState(const Vec3 &ori_, const Vec3 &dir_, const Color &color_, unsigned long long index_)
+			: ori(ori_), dir(dir_), color(color_), index(index_), object(-1), intersection(MISS) {}
+	};
+	// 内部接口：以波前方式追踪一批光子，wave在追踪过程中被消耗
+	void traceWavefront(std::vector<PhotonState> &wave);
+	// 内部接口：自适应马尔可夫链模式下发射一轮光子
+	void emitPhotonsAdaptive(int nPhoton, double weight = 1.0);
+	// 内部接口：按原始样本空间向量u追踪一条光子路径，记录其落点；nTotal为本轮的光子总数。
+	// 超出u的维度（如某次弹射用了多于PSS_DIMS_PER_BOUNCE个随机数）取自第index个PATH流，各条路径互不相同
+	void tracePath(const std::vector<double> &u, unsigned long long index, double nTotal, std::vector<Photon> &landings);
+	bool isVisible(const std::vector<Photon> &landings) const;
 	// 内部接口：根据本次发射的光子更新碰撞点图
 	void updateKDMap();
-	// 内部接口：根据场景中光子密度分布，估算各像素辉度
-	void evalIrradiance(int nIter);
+	// 内部接口：根据场景中光子密度分布，估算各像素辉度，fluxScale为光通量的归一化系数
+	void evalIrradiance(double nIter, double fluxScale);
+	void buildEvalCache();
+	int pixelOf(const HitPoint &hp) const { return m_viewBase[hp.view] + hp.row * m_photos[hp.view].width() + hp.col; }
+	// 内部接口：概率渐进式光子映射，迭代至多nLevelIter轮，每轮nPhoton个光子，返回实际迭代的轮数
+	int probabilisticPass(int nPhoton, int nLevelIter);
+	void evalProbabilistic(int nIter);
+	// 内部接口：等待后台线程完成上一轮的辉度估算与图像保存，以及检查点的写入
+	void finishOutput();
+	// 内部接口：在后台把当前状态写入检查点（上一次尚未写完时跳过）；载入检查点，成功时返回true
+	// nIter为累计的（等效）迭代轮数，iteration为全分辨率下已完成的迭代轮数
+	void saveCheckpoint(double nIter, int iteration);
+	bool loadCheckpoint(double &nIter, int &iteration);
+	// 内部接口：把当前图像发布到实时预览通道，在后台输出线程中调用；nPhoton为已发射的光子总数
+	void publishPreview(double nIter, unsigned long long nPhoton);
 
 private:
 	World *m_world;
-	std::vector<std::vector<Vec3>> m_photo;
-	std::vector<HitPoint> m_hitpoints;
+	std::vector<Framebuffer> m_photos;	// 每个视图一张图像
+	ImageWriter m_writer;	// 后台图像输出
+	std::string m_channelPath;	// 实时预览通道的文件，空串为不开启
+	PreviewChannel m_channel;
+	HitPointArray m_hitpoints;
 	std::vector<HitPoint> m_bgHitpoints;
-	KDMap m_kdMap;
+	HitPointMap *m_hitpointMap;	// 碰撞点图，KD树或哈希网格
+	bool m_hashGrid;			// 是否使用哈希网格
+	bool m_outOfCore;			// 是否开启超大图像模式
+	size_t m_residentLimit;		// 超大图像模式下映射内存的常驻上限（字节），0为不限
+
+	int m_nPreviewLevel, m_nPreviewIter;	// 预览的级数、每级的迭代轮数
+	double m_scale;		// 当前渲染的分辨率比例
+	double m_radius;	// 当前分辨率下碰撞点的初始半径
+
+	unsigned long long m_seed;		// 随机数种子
+	unsigned long long m_nEmitted;	// 已发射的光子总数，用作光子的全局编号
+	bool m_useQMC;			// 是否使用拟蒙特卡洛光子发射
+	QMCSequence *m_qmc;		// 低差异序列，未开启时为NULL
+	bool m_useProjMap;		// 是否使用投影图发射光子
+	std::vector<ProjectionMap> m_projMaps;	// 各光源的投影图，非点光源的投影图为空
+
+	// 自适应马尔可夫链光子追踪的一条链
+	struct MarkovChain
+	{
+		std::vector<double> u;			// 当前状态（一条可见的光子路径）在原始样本空间中的坐标，为空表示尚未找到
+		std::vector<Photon> landings;	// 当前状态的光子落点
+		double mutationSize;			// 自适应的变异步长，使接受率趋近0.234
+		double nAccepted, nMutated;		// 变异被接受的次数、变异的次数
+		MarkovChain() : mutationSize(0.1), nAccepted(0), nMutated(0) {}
+	};
+	static const int N_CHAIN = 64;	// 链的条数固定，与线程数无关，因而结果可复现
+	bool m_adaptive;
+	std::vector<MarkovChain> m_chains;
+	double m_nUniform, m_nUniformVisible;	// 均匀采样的光子路径数、其中可见的路径数
+	double m_fluxScale;	// 光通量的归一化系数，自适应模式下为可见路径比例的估计值，否则为1
+
+	std::future<void> m_output;	// 后台进行中的辉度估算与图像保存
+
+	// 辉度估算的缓存：碰撞点按像素分组存放（CSR），各像素只由一个任务计算，无需同步；
+	// 背景色与已冻结碰撞点的贡献不再变化，预先累加到各像素的静态部分，不含未冻结且收到过光的碰撞点的像素无需重算
+	struct EvalTerm
+	{
+		Color term;			// weight * phi / radius2，乘以10000 * fluxScale / 轮数即为辉度
+		double iter0, iter1;
+		bool folded;		// 已冻结并计入静态部分
+		EvalTerm() : iter0(0), iter1(-1), folded(false) {}
+	};
+	// 以下与碰撞点数、像素数成正比的数组与碰撞点一样，开启超大图像模式时存放在映射内存中
+	bool m_evalReady;				// 缓存是否对应当前的碰撞点
+	std::vector<int> m_viewBase;	// 各视图的像素在全局像素编号中的起点
+	std::vector<int, MappedAllocator<int>> m_pixelStart;	// 第p个像素的碰撞点位于m_terms[m_pixelStart[p], m_pixelStart[p + 1])
+	std::vector<int, MappedAllocator<int>> m_slotOf;		// 各碰撞点在m_terms中的位置
+	std::vector<EvalTerm, MappedAllocator<EvalTerm>> m_terms;
+	std::vector<Color, MappedAllocator<Color>> m_static;	// 各像素的静态部分
+	std::vector<char, MappedAllocator<char>> m_live;		// 各像素是否需要重算
+	std::vector<int, MappedAllocator<int>> m_touched;		// 自上次估算以来光通量、半径或冻结状态变化了的碰撞点
+	bool m_touchAll;				// 所有碰撞点都可能变化了
+
+	Scheduler *m_scheduler;	// 任务调度器，光子发射、光线追踪等均由其并行
+	int m_nThread;			// 工作线程数，0为全部逻辑核
+	bool m_pin;				// 是否将工作线程绑定到各个核上
+	bool m_wavefront;		// 是否使用波前式光子追踪
+	bool m_probabilistic;	// 是否使用概率渐进式光子映射
+	std::vector<Color, MappedAllocator<Color>> m_pppmSum;	// 概率渐进式光子映射中各碰撞点处各轮估计值之和
+	size_t m_pppmMemory;	// 概率渐进式光子映射中同时进行的各轮光子图的内存预算（字节）
+
+	double m_targetTime;	// 每轮迭代的目标时间（秒），0为不调整
+	double m_photonRate;	// 测得的光子吞吐量（个/秒）
+	double m_iterOverhead;	// 测得的每轮固定开销（秒）
+
+	double m_timeBudget;	// 时间预算（秒），0为不限
+	double m_noiseTarget;	// 像素相对误差的目标，0为不限
+	bool m_focus;			// 是否冻结已收敛的碰撞点
+	std::atomic<bool> m_stop;	// 停止请求
+	std::chrono::steady_clock::time_point m_renderStart;	// 本次渲染的开始时间
+
+	std::string m_checkpointPath;	// 检查点文件，空串为不写
+	double m_checkpointInterval;	// 写检查点的间隔（秒）
+	std::chrono::steady_clock::time_point m_lastCheckpoint;	// 上一次写检查点的时间
+	std::future<void> m_checkpoint;	// 后台进行中的检查点写入
 };
\ No newline at end of file
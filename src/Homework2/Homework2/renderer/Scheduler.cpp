@@ -0,0 +1,124 @@
+#include "Scheduler.h"
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+using namespace std;
+
+static thread_local int t_workerId = -1;	// 当前线程在调度器中的编号，非工作线程为-1
+
+Scheduler::Scheduler(int nThread, bool pin)
+	: m_pin(pin), m_nPending(0), m_next(0), m_stop(false)
+{
+	if (nThread <= 0) nThread = max(1u, thread::hardware_concurrency());
+	for (int i = 0; i < nThread; i++) m_workers.push_back(new Worker);
+	for (int i = 0; i < nThread; i++) m_threads.push_back(thread(&Scheduler::run, this, i));
+}
+
+Scheduler::~Scheduler()
+{
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_wake.notify_all();
+	for (thread &t : m_threads) t.join();
+	for (Worker *worker : m_workers) delete worker;
+}
+
+void Scheduler::parallelFor(long long first, long long last, long long grain, const Func &func)
+{
+	if (last <= first) return;
+	grain = max(grain, 1LL);
+	if (t_workerId >= 0) { func(first, last, t_workerId); return; }
+
+	Job job;
+	job.func = &func;
+	long long nTask = (last - first + grain - 1) / grain;
+	job.remaining = nTask;
+
+	// 按块轮流放入各个队列，相邻的块落在同一队列中，保持数据局部性
+	int nWorker = size(), start = m_next.fetch_add(1) % nWorker;
+	long long perWorker = (nTask + nWorker - 1) / nWorker;
+	for (long long t = 0; t < nTask; t++)
+	{
+		Task task = { &job, first + t * grain, min(first + (t + 1) * grain, last) };
+		Worker *worker = m_workers[(start + t / perWorker) % nWorker];
+		lock_guard<mutex> lock(worker->mutex);
+		worker->tasks.push_back(task);
+	}
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_nPending += nTask;
+	}
+	m_wake.notify_all();
+
+	unique_lock<mutex> lock(job.mutex);
+	job.done.wait(lock, [&job]() { return job.remaining.load() == 0; });
+}
+
+void Scheduler::run(int id)
+{
+	t_workerId = id;
+	if (m_pin)
+	{
+#ifdef _WIN32
+		SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << (id % (8 * sizeof(DWORD_PTR))));
+#else
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(id % CPU_SETSIZE, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+	}
+
+	while (true)
+	{
+		Task task;
+		if (pop(id, task) || steal(id, task)) { execute(task, id); continue; }
+
+		unique_lock<mutex> lock(m_mutex);
+		if (m_stop) return;
+		if (m_nPending.load() > 0) continue;	// 加锁前又有新任务到达
+		m_wake.wait(lock);
+	}
+}
+
+bool Scheduler::pop(int id, Task &task)
+{
+	Worker *worker = m_workers[id];
+	lock_guard<mutex> lock(worker->mutex);
+	if (worker->tasks.empty()) return false;
+	task = worker->tasks.back();
+	worker->tasks.pop_back();
+	m_nPending--;
+	return true;
+}
+
+bool Scheduler::steal(int id, Task &task)
+{
+	int nWorker = size();
+	for (int k = 1; k < nWorker; k++)
+	{
+		Worker *victim = m_workers[(id + k) % nWorker];
+		lock_guard<mutex> lock(victim->mutex);
+		if (victim->tasks.empty()) continue;
+		task = victim->tasks.front();
+		victim->tasks.pop_front();
+		m_nPending--;
+		return true;
+	}
+	return false;
+}
+
+void Scheduler::execute(const Task &task, int id)
+{
+	Job *job = task.job;
+	(*job->func)(task.begin, task.end, id);
+	// 在锁内计数，保证提交者被唤醒并销毁job之前，这里已经不再访问job
+	lock_guard<mutex> lock(job->mutex);
+	if (--job->remaining == 0) job->done.notify_all();
+}
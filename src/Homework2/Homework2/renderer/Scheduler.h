@@ -0,0 +1,65 @@
+#pragma once
+// 任务调度器Scheduler
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+/**
+任务调度器Scheduler，基于工作窃取（work stealing）：
+固定数量的工作线程各自拥有一个任务双端队列，线程从自己的队尾取任务，自己的队列空了就从其他线程的队首窃取。
+parallelFor把区间切成小块分发到各个队列，路径长短不一的光子、复杂程度不同的图块都能自动负载均衡，
+不会像静态划分的omp for那样在每轮末尾等待最慢的线程。允许多个线程同时提交任务（如后台输出线程）
+*/
+class Scheduler
+{
+public:
+	typedef std::function<void(long long begin, long long end, int worker)> Func;
+
+	// nThread为0时使用全部逻辑核；pin为true时将第i个工作线程绑定到第i个逻辑核上，
+	// 相邻编号的线程落在同一CPU插槽（NUMA节点）上，配合按块分发的任务，各线程的数据也大致留在本节点内
+	Scheduler(int nThread = 0, bool pin = false);
+	~Scheduler();
+
+	int size() const { return int(m_workers.size()); }
+	// 并行执行func(begin, end, worker)：[first, last)被切分为不超过grain的块，worker为执行该块的线程编号
+	// 阻塞直到所有块完成；在工作线程内部嵌套调用时直接串行执行
+	void parallelFor(long long first, long long last, long long grain, const Func &func);
+
+private:
+	struct Job
+	{
+		const Func *func;
+		std::atomic<long long> remaining;	// 尚未完成的块数
+		std::mutex mutex;
+		std::condition_variable done;
+	};
+	struct Task
+	{
+		Job *job;
+		long long begin, end;
+	};
+	struct Worker
+	{
+		std::deque<Task> tasks;
+		std::mutex mutex;
+	};
+
+	void run(int id);	// 工作线程的主循环
+	bool pop(int id, Task &task);	// 从自己的队尾取任务
+	bool steal(int id, Task &task);	// 从其他线程的队首窃取任务
+	void execute(const Task &task, int id);
+
+	std::vector<Worker*> m_workers;
+	std::vector<std::thread> m_threads;
+	bool m_pin;
+	std::atomic<long long> m_nPending;	// 所有队列中的任务总数
+	std::atomic<int> m_next;			// 下一批任务从哪个队列开始分发
+	std::mutex m_mutex;					// 保护m_stop，并配合m_wake使用
+	std::condition_variable m_wake;		// 有新任务时唤醒空闲线程
+	bool m_stop;
+};
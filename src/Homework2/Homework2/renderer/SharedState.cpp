@@ -0,0 +1,221 @@
+#include "SharedState.h"
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include <cstring>
+#include <cstdio>
+#include <map>
+#include <mutex>
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////////
+// MappedFile
+
+bool MappedFile::create(const string &path, size_t size)
+{
+	return map(path, size, true);
+}
+
+bool MappedFile::open(const string &path)
+{
+	return map(path, 0, false);
+}
+
+#ifdef _WIN32
+bool MappedFile::map(const string &path, size_t size, bool create)
+{
+	close();
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, create ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return false;
+	if (!create)
+	{
+		LARGE_INTEGER fileSize;
+		GetFileSizeEx(file, &fileSize);
+		size = size_t(fileSize.QuadPart);
+	}
+	HANDLE mapping = size ? CreateFileMappingA(file, NULL, PAGE_READWRITE, DWORD(uint64_t(size) >> 32), DWORD(size), NULL) : NULL;
+	void *data = mapping ? MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size) : NULL;
+	if (!data)
+	{
+		if (mapping) CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+	m_file = file; m_mapping = mapping; m_data = data; m_size = size;
+	return true;
+}
+
+bool MappedFile::sync()
+{
+	return m_data && FlushViewOfFile(m_data, m_size) && FlushFileBuffers(m_file);
+}
+
+bool MappedFile::replace(const string &from, const string &to)
+{
+	return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+}
+
+void MappedFile::close()
+{
+	if (m_data) UnmapViewOfFile(m_data);
+	if (m_mapping) CloseHandle(m_mapping);
+	if (m_file) CloseHandle(m_file);
+	m_data = NULL; m_mapping = NULL; m_file = NULL; m_size = 0;
+}
+#else
+bool MappedFile::map(const string &path, size_t size, bool create)
+{
+	close();
+	int fd = ::open(path.c_str(), create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR, 0644);
+	if (fd < 0) return false;
+	if (create && ftruncate(fd, off_t(size)) != 0) { ::close(fd); return false; }
+	if (!create)
+	{
+		struct stat st;
+		if (fstat(fd, &st) != 0) { ::close(fd); return false; }
+		size = size_t(st.st_size);
+	}
+	void *data = size ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+	if (data == MAP_FAILED) { ::close(fd); return false; }
+	m_file = (void*)(intptr_t(fd) + 1); m_data = data; m_size = size;
+	return true;
+}
+
+bool MappedFile::sync()
+{
+	return m_data && msync(m_data, m_size, MS_SYNC) == 0 && fsync(int(intptr_t(m_file) - 1)) == 0;
+}
+
+bool MappedFile::replace(const string &from, const string &to)
+{
+	return rename(from.c_str(), to.c_str()) == 0;
+}
+
+void MappedFile::close()
+{
+	if (m_data) munmap(m_data, m_size);
+	if (m_file) ::close(int(intptr_t(m_file) - 1));
+	m_data = NULL; m_file = NULL; m_size = 0;
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////////
+// MappedMemory
+
+static mutex g_mappedMutex;
+static string g_mappedDir;
+static map<void*, MappedFile*> g_mapped;	// 各映射区间的起始地址及其文件
+static size_t g_mappedSize = 0;
+static unsigned g_mappedCount = 0;	// 用于生成临时文件名
+
+void MappedMemory::setDirectory(const string &dir)
+{
+	lock_guard<mutex> lock(g_mappedMutex);
+	g_mappedDir = dir;
+}
+
+bool MappedMemory::enabled()
+{
+	lock_guard<mutex> lock(g_mappedMutex);
+	return !g_mappedDir.empty();
+}
+
+void *MappedMemory::allocate(size_t size)
+{
+	lock_guard<mutex> lock(g_mappedMutex);
+	if (g_mappedDir.empty() || size < MIN_SIZE) return ::operator new(size, nothrow);
+
+#ifdef _WIN32
+	unsigned long pid = GetCurrentProcessId();
+#else
+	unsigned long pid = (unsigned long)getpid();
+#endif
+	char name[64];
+	sprintf(name, "/ppm-%lu-%u.swap", pid, g_mappedCount++);
+	string path = g_mappedDir + name;
+	MappedFile *file = new MappedFile;
+	if (!file->create(path, size))
+	{
+		delete file;
+		return ::operator new(size, nothrow);	// 无法创建文件时退回堆分配
+	}
+	remove(path.c_str());	// 映射在关闭前一直有效，文件随之回收
+	g_mapped[file->data()] = file;
+	g_mappedSize += size;
+	return file->data();
+}
+
+void MappedMemory::deallocate(void *p, size_t size)
+{
+	lock_guard<mutex> lock(g_mappedMutex);
+	map<void*, MappedFile*>::iterator it = g_mapped.find(p);
+	if (it == g_mapped.end())
+	{
+		::operator delete(p);
+		return;
+	}
+	g_mappedSize -= it->second->size();
+	delete it->second;
+	g_mapped.erase(it);
+}
+
+size_t MappedMemory::mappedSize()
+{
+	lock_guard<mutex> lock(g_mappedMutex);
+	return g_mappedSize;
+}
+
+void MappedMemory::trim()
+{
+	lock_guard<mutex> lock(g_mappedMutex);
+	for (auto &item : g_mapped)
+	{
+#ifdef _WIN32
+		VirtualUnlock(item.second->data(), item.second->size());	// 对未锁定的页，作用是移出工作集
+#else
+		msync(item.second->data(), item.second->size(), MS_ASYNC);
+		madvise(item.second->data(), item.second->size(), MADV_DONTNEED);
+#endif
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// SharedState
+
+void SharedState::layout(int nHitpoint)
+{
+	m_hitpointOffset = align(sizeof(Header));
+	m_slotOffset = m_hitpointOffset + align(sizeof(HitPoint) * nHitpoint);
+	m_slotSize = align(sizeof(Slot)) + align(sizeof(Delta) * nHitpoint);
+}
+
+bool SharedState::create(const string &path, int nHitpoint, int nWorker, int nPhoton)
+{
+	layout(nHitpoint);
+	if (!m_file.create(path, m_slotOffset + m_slotSize * nWorker)) return false;
+	memset(m_file.data(), 0, m_file.size());
+	Header *h = header();
+	h->nHitpoint = nHitpoint; h->nWorker = nWorker; h->nPhoton = nPhoton;
+	h->epoch = 0; h->done = 0; h->heartbeat = 0; h->timeout = 60;
+	for (int w = 0; w < nWorker; w++) slot(w)->epoch = 0;
+	atomic_thread_fence(memory_order_release);	// 其余字段写好之后才写入MAGIC
+	h->magic = MAGIC;
+	return true;
+}
+
+bool SharedState::open(const string &path)
+{
+	if (!m_file.open(path) || m_file.size() < sizeof(Header)) return false;
+	Header *h = header();
+	if (h->magic != MAGIC) { m_file.close(); return false; }
+	layout(h->nHitpoint);
+	if (m_file.size() < m_slotOffset + m_slotSize * h->nWorker) { m_file.close(); return false; }
+	return true;
+}
@@ -0,0 +1,137 @@
+#pragma once
+// 内存映射文件MappedFile，映射内存MappedMemory与分配器MappedAllocator，多进程渲染的共享状态SharedState
+
+#include <string>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+
+/**
+内存映射文件MappedFile：把整个文件映射到本进程的地址空间，同一主机上映射同一文件的各进程看到同一份内存
+*/
+class MappedFile
+{
+public:
+	MappedFile() : m_data(NULL), m_size(0), m_file(NULL), m_mapping(NULL) {}
+	~MappedFile() { close(); }
+
+	// 创建（截断为size字节）或打开已有的文件并映射，失败时返回false
+	bool create(const std::string &path, size_t size);
+	bool open(const std::string &path);
+	void close();
+	// 把映射内容写回磁盘并等待完成
+	bool sync();
+	// 以文件from原子地替换文件to（to已存在时覆盖），用于先写临时文件、写完后再替换的安全写入
+	static bool replace(const std::string &from, const std::string &to);
+
+	void *data() const { return m_data; }
+	size_t size() const { return m_size; }
+
+private:
+	MappedFile(const MappedFile &);
+	MappedFile &operator=(const MappedFile &);
+	bool map(const std::string &path, size_t size, bool create);
+
+	void *m_data;
+	size_t m_size;
+	void *m_file, *m_mapping;	// Windows下的文件、映射句柄；POSIX下m_file存放文件描述符 + 1
+};
+
+/**
+映射内存MappedMemory，用于超出物理内存的大数组（碰撞点、KD树结点等）：
+设置了交换目录后，不小于MIN_SIZE的分配改为映射该目录下的一个临时文件（创建后即删除，进程退出时自动回收），
+物理内存紧张时操作系统直接把页写回文件、换出，而不必占用交换区；未设置时等同于普通的堆分配。
+数组按空间顺序（Morton码）存放时，一次迭代中相邻访问的数据位于相邻的页上，换页代价随之降低
+*/
+class MappedMemory
+{
+public:
+	static const size_t MIN_SIZE = 1 << 20;
+
+	// 设置交换目录，空串为关闭；只影响此后的分配
+	static void setDirectory(const std::string &dir);
+	static bool enabled();
+	static void *allocate(size_t size);
+	static void deallocate(void *p, size_t size);
+	static size_t mappedSize();	// 当前映射的总字节数
+	// 把所有映射区间的常驻页交还操作系统：修改已异步写回文件，之后访问时再按需读入
+	static void trim();
+};
+
+/**
+基于MappedMemory的分配器MappedAllocator，供std::vector使用；各实例之间无状态，可以互相释放
+*/
+template <class T>
+struct MappedAllocator
+{
+	typedef T value_type;
+	MappedAllocator() {}
+	template <class U> MappedAllocator(const MappedAllocator<U> &) {}
+	T *allocate(size_t n) {
+		void *p = MappedMemory::allocate(n * sizeof(T));
+		if (!p) throw std::bad_alloc();
+		return (T*)p;
+	}
+	void deallocate(T *p, size_t n) { MappedMemory::deallocate(p, n * sizeof(T)); }
+	template <class U> bool operator==(const MappedAllocator<U> &) const { return true; }
+	template <class U> bool operator!=(const MappedAllocator<U> &) const { return false; }
+};
+
+/**
+多进程渲染的共享状态SharedState，存放于一个内存映射文件中，布局为：
+[Header][HitPoint × nHitpoint][(Slot, Delta × nHitpoint) × nWorker]，各段按缓存行对齐。
+协调进程完成PASS1后写入碰撞点的位置、所在物体的编号与半径，此后每一轮（epoch）：
+1. 协调进程写入各碰撞点的新半径，再递增epoch；
+2. 各工作进程读取半径、发射一轮光子，把各碰撞点的光通量增量写入自己的槽位，最后把槽位的epoch置为本轮；
+3. 协调进程等待所有槽位报告本轮，超时未报告的工作进程（如已崩溃）本轮不计入，然后合并增量、更新半径；
+   超时仍无任何工作进程报告时保持本轮不变，继续等待。
+所有状态都在协调进程一侧，工作进程崩溃不会丢失已累计的结果，重新启动后从当前轮次继续即可；
+协调进程的心跳停止超过timeout秒时，工作进程认为其已崩溃而退出
+*/
+class SharedState
+{
+public:
+	static const uint32_t MAGIC = 0x50504D32;	// "PPM2"
+
+	struct Header
+	{
+		uint32_t magic;
+		int32_t nHitpoint, nWorker, nPhoton;	// 碰撞点数、工作进程数、每个工作进程每轮的光子数
+		std::atomic<long long> epoch;	// 当前轮次，从1开始；0表示碰撞点尚未写好
+		std::atomic<int> done;			// 渲染结束，工作进程应退出
+		std::atomic<long long> heartbeat;	// 协调进程存活时不断递增
+		double timeout;					// 超时（秒）：协调进程不再等待未报告的工作进程，工作进程也据此判断协调进程是否已崩溃
+	};
+	struct HitPoint
+	{
+		double P[3];
+		int32_t object;		// 所在物体在World::objects中的下标
+		double radius2;
+	};
+	struct Slot
+	{
+		std::atomic<long long> epoch;	// 本槽位中的增量属于哪一轮，0为尚无
+	};
+	struct Delta
+	{
+		double phi[3];
+		double nNew;
+	};
+
+	// 协调进程创建共享文件；工作进程打开已有的共享文件
+	bool create(const std::string &path, int nHitpoint, int nWorker, int nPhoton);
+	bool open(const std::string &path);
+
+	Header *header() const { return (Header*)m_file.data(); }
+	HitPoint *hitpoints() const { return (HitPoint*)((char*)m_file.data() + m_hitpointOffset); }
+	Slot *slot(int worker) const { return (Slot*)((char*)m_file.data() + m_slotOffset + worker * m_slotSize); }
+	Delta *deltas(int worker) const { return (Delta*)((char*)slot(worker) + align(sizeof(Slot))); }
+
+private:
+	static size_t align(size_t size) { return (size + 63) & ~size_t(63); }
+	void layout(int nHitpoint);
+
+	MappedFile m_file;
+	size_t m_hitpointOffset, m_slotOffset, m_slotSize;
+};
@@ -1,145 +1,451 @@
 #include "utils.h"
+#include <cassert>
 #include <climits>
+#include <cmath>
 #include <iostream>
 #include <algorithm>
+#include <vector>
+#include <cstdint>
 using namespace std;
 
-void KDMap::load(int _size, HitPoint *_data)
+const double FluxCounter::SCALE = 17592186044416.0;	// 2^44，单个光子的能量约为1e-7量级，精度足够且不会溢出
+
+///////////////////////////////////////////////////////////////////////////////////
+// HitPointMap
+
+HitPointMap::~HitPointMap()
+{
+	MappedMemory::deallocate(m_flux, sizeof(FluxCounter) * m_size);
+}
+
+void HitPointMap::load(int _size, HitPoint *_data)
 {
-	m_nNode = 0;
+	MappedMemory::deallocate(m_flux, sizeof(FluxCounter) * m_size);	// 允许重复load（如预览时逐级细化）
 	m_size = _size;
 	m_data = _data;
-	m_index = new int[m_size];
-	m_memory = new Node[m_size];
-	for (int i = 0; i < m_size; ++i) 
-		m_index[i] = i;
+	m_flux = (FluxCounter*)MappedMemory::allocate(sizeof(FluxCounter) * m_size);
+	for (int i = 0; i < m_size; i++)	// 累加器均为整数，全零即初值
+	{
+		for (int c = 0; c < 3; c++) m_flux[i].phi[c].store(0, memory_order_relaxed);
+		m_flux[i].nNew.store(0, memory_order_relaxed);
+	}
+	HitPointMap::updateBox();
 }
 
-void KDMap::medianPartition(int l, int r, int dim, int k)
+void HitPointMap::toFixed(const Color &color, long long *phi)
 {
-	int mid = (l + r) >> 1, temp = m_index[mid];
-	int i = l, j = r;
-	while (i < j)
+	for (int c = 0; c < 3; c++) phi[c] = llround(color[c] * FluxCounter::SCALE);
+}
+
+bool HitPointMap::outOfBox(const Vec3 &P, double maxRadius2) const
+{
+	for (int i = 0; i < K; ++i)
 	{
-		while (m_data[m_index[i]].P[dim] < m_data[temp].P[dim]) ++i;
-		while (m_data[m_index[j]].P[dim] > m_data[temp].P[dim]) --j;
-		if (i <= j)
-		{
-			int t = m_index[i]; m_index[i] = m_index[j]; m_index[j] = t;
-			++i; --j;
-		}
+		if (P[i] < m_boxMin[i] && (m_boxMin[i] - P[i]) * (m_boxMin[i] - P[i]) > maxRadius2) return true;
+		if (P[i] > m_boxMax[i] && (P[i] - m_boxMax[i]) * (P[i] - m_boxMax[i]) > maxRadius2) return true;
 	}
-	if (l < j && l <= k && k <= j) medianPartition(l, j, dim, k);
-	if (i < r && i <= k && k <= r) medianPartition(i, r, dim, k);
+	return false;
 }
 
-KDMap::Node* KDMap::build(int l, int r, double *min, double *max)
+void HitPointMap::flush(int begin, int end, vector<int> *touched)
 {
-	if (r <= l) return NULL;
-	double temp = -1; int split;
-	for (int i = 0; i < K; ++i) if (max[i] - min[i] > temp)
+	for (int i = begin; i < end; ++i)
 	{
-		temp = max[i] - min[i];
-		split = i;
+		FluxCounter &flux = m_flux[i];
+		int nNew = flux.nNew.load(memory_order_relaxed);
+		if (nNew == 0) continue;
+		if (touched) touched->push_back(i);
+		m_data[i].nNew += nNew;
+		for (int c = 0; c < 3; c++) m_data[i].phi[c] += flux.phi[c].load(memory_order_relaxed) / FluxCounter::SCALE;
+		for (int c = 0; c < 3; c++) flux.phi[c].store(0, memory_order_relaxed);
+		flux.nNew.store(0, memory_order_relaxed);
 	}
-	int mid = (l + r) >> 1;
-	medianPartition(l, r - 1, split, mid);
-	m_memory[m_nNode].value = m_index[mid];
-	m_memory[m_nNode].split = split;
-	Node *node = &m_memory[m_nNode++];
+}
 
-	temp = max[split];
-	max[split] = m_data[m_index[mid]].P[split];
-	node->left = build(l, mid, min, max);
-	max[split] = temp;
+void HitPointMap::flushCache(FluxCache &cache)
+{
+	for (int slot = 0; slot < FluxCache::SIZE; ++slot)
+	{
+		if (cache.pos[slot] < 0) continue;
+		accumulate(cache.pos[slot], cache.phi[slot], cache.nNew[slot]);
+		cache.pos[slot] = -1;
+	}
+}
 
-	temp = min[split];
-	min[split] = m_data[m_index[mid]].P[split];
-	node->right = build(mid + 1, r, min, max);
-	min[split] = temp;
+// 把[0, 1]内的坐标量化为21位，各位间隔两位展开
+static uint64_t expandBits(double x)
+{
+	uint64_t v = uint64_t(min(max(x, 0.0), 1.0) * 2097151.0);
+	v = (v | v << 32) & 0x1f00000000ffffull;
+	v = (v | v << 16) & 0x1f0000ff0000ffull;
+	v = (v | v << 8) & 0x100f00f00f00f00full;
+	v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+	v = (v | v << 2) & 0x1249249249249249ull;
+	return v;
+}
 
-	m_data[node->value].maxRadius2 = m_data[node->value].radius2;
-	if (node->left && m_data[node->left->value].maxRadius2 > m_data[node->value].maxRadius2)
-		m_data[node->value].maxRadius2 = m_data[node->left->value].maxRadius2;
+uint64_t mortonCode(const Vec3 &P, const double *boxMin, const double *boxMax)
+{
+	uint64_t code = 0;
+	for (int k = 0; k < 3; ++k)
+		code |= expandBits((P[k] - boxMin[k]) / max(boxMax[k] - boxMin[k], EPSILON)) << (2 - k);
+	return code;
+}
 
-	if (node->right && m_data[node->right->value].maxRadius2 > m_data[node->value].maxRadius2)
-		m_data[node->value].maxRadius2 = m_data[node->right->value].maxRadius2;
+void HitPointMap::insertPhotons(const vector<Photon> &photons)
+{
+	// 剔除包围盒外的光子，其余按落点在包围盒内的Morton码排序
+	vector<pair<uint64_t, int>> keys;
+	keys.reserve(photons.size());
+	for (int i = 0; i < (int)photons.size(); ++i)
+		if (!outOfBox(photons[i].P)) keys.push_back(make_pair(mortonCode(photons[i].P, m_boxMin, m_boxMax), i));
+	sort(keys.begin(), keys.end());
 
-	return node;
+	// 每PACKET个相邻的光子为一组
+	FluxCache *cache = new FluxCache;	// 体积较大，不放在栈上
+	const Photon *packet[PACKET];
+	long long phi[PACKET][3];
+	for (size_t first = 0; first < keys.size(); first += PACKET)
+	{
+		int n = int(min(keys.size() - first, size_t(PACKET)));
+		for (int j = 0; j < n; ++j)
+		{
+			packet[j] = &photons[keys[first + j].second];
+			toFixed(packet[j]->color, phi[j]);
+		}
+		insertPacket(packet, phi, n, *cache);
+	}
+	flushCache(*cache);
+	delete cache;
 }
 
-void KDMap::build()
+void HitPointMap::updateBox(Scheduler *)
 {
-	m_nNode = 0;
-	double *min = new double[K], *max = new double[K];
-	for (int i = 0; i < K; ++i) min[i] = LONG_MAX, max[i] = LONG_MIN;
+	for (int i = 0; i < K; ++i) m_boxMin[i] = LONG_MAX, m_boxMax[i] = LONG_MIN;
 	for (int i = 0; i < m_size; ++i)
 	{
-		Vec3 temp = m_data[i].P;;
+		if (m_data[i].frozen()) continue;
 		for (int j = 0; j < K; ++j)
 		{
-			if (m_data[i].P[j] < min[j]) min[j] = m_data[i].P[j];
-			if (m_data[i].P[j] > max[j]) max[j] = m_data[i].P[j];
+			if (m_data[i].P[j] < m_boxMin[j]) m_boxMin[j] = m_data[i].P[j];
+			if (m_data[i].P[j] > m_boxMax[j]) m_boxMax[j] = m_data[i].P[j];
 		}
 	}
-	m_root = build(0, m_size, min, max);
 }
 
-void KDMap::insertPhoton(Node *node, const Photon &photon)
+///////////////////////////////////////////////////////////////////////////////////
+// KDMap
+
+void KDMap::load(int _size, HitPoint *_data)
 {
-	if (node == NULL) return;
+	HitPointMap::load(_size, _data);
+	MappedMemory::deallocate(m_memory, m_memorySize);
+	m_memorySize = sizeof(Node) * max(m_size, 1) + 64;
+	m_memory = (char*)MappedMemory::allocate(m_memorySize);
+	m_nodes = (Node*)((uintptr_t(m_memory) + 63) & ~uintptr_t(63));
+}
 
-	int pos = node->value;
-	if (dot(m_data[pos].P - photon.P, m_data[pos].P - photon.P) < m_data[pos].radius2)
-		if (photon.object == m_data[pos].object)
-		{
-			m_data[pos].nNew += 1;
-			double diffuse = m_data[pos].object->diff;
-			m_data[pos].phi += photon.color;
-		}
+int KDMap::leftSize(int n)
+{
+	if (n <= 1) return 0;
+	int full = 1;	// 不超过n的最大满二叉树的结点数 + 1，即2^h
+	while (full * 2 <= n + 1) full *= 2;
+	int last = n - (full - 1);	// 最底层的结点数
+	return (full / 2 - 1) + min(last, full / 2);
+}
 
-	int split = node->split;
-	Node *another;
-	if (photon.P[split] < m_data[pos].P[split])
+void KDMap::build(Item *items, int n, int node, int depth, vector<Subtree> *subtrees)
+{
+	if (n <= 0) return;
+	// 上面几层划分完毕，或子树已经较小时，留给调度器并行建立；左右子树的结点与下标区间互不重叠
+	const int PARALLEL_SIZE = 1 << 15, PARALLEL_DEPTH = 4;
+	if (subtrees && (depth == PARALLEL_DEPTH || n <= PARALLEL_SIZE))
 	{
-		another = node->right;
-		insertPhoton(node->left, photon);
+		Subtree subtree = { items, n, node, depth };
+		subtrees->push_back(subtree);
+		return;
 	}
-	else
+	// 沿包围盒最长的维度划分
+	double min[K], max[K];
+	for (int k = 0; k < K; ++k) min[k] = LONG_MAX, max[k] = LONG_MIN;
+	for (int i = 0; i < n; ++i) for (int k = 0; k < K; ++k)
+	{
+		double x = items[i].P[k];
+		if (x < min[k]) min[k] = x;
+		if (x > max[k]) max[k] = x;
+	}
+	int split = 0;
+	for (int k = 1; k < K; ++k) if (max[k] - min[k] > max[split] - min[split]) split = k;
+
+	int left = leftSize(n);
+	nth_element(items, items + left, items + n,
+		[split](const Item &a, const Item &b) { return a.P[split] < b.P[split]; });
+	const HitPoint &hp = m_data[items[left].index];
+	Node &cur = m_nodes[node];
+	for (int k = 0; k < K; ++k) cur.P[k] = hp.P[k];
+	cur.radius2 = cur.maxRadius2 = hp.radius2;
+	cur.object = hp.object;
+	cur.value = items[left].index;
+	cur.split = split;
+
+	build(items, left, 2 * node + 1, depth + 1, subtrees);
+	build(items + left + 1, n - left - 1, 2 * node + 2, depth + 1, subtrees);
+}
+
+void KDMap::build(Scheduler *scheduler)
+{
+	vector<Item, MappedAllocator<Item>> items;	// 与碰撞点数成正比，同样放在映射内存中
+	items.reserve(m_size);
+	for (int i = 0; i < m_size; ++i)
+	{
+		if (m_data[i].frozen()) continue;
+		Item item;
+		for (int k = 0; k < K; ++k) item.P[k] = m_data[i].P[k];
+		item.index = i;
+		items.push_back(item);
+	}
+	m_nNode = items.size();
+	if (scheduler)
+	{
+		vector<Subtree> subtrees;
+		build(items.data(), m_nNode, 0, 0, &subtrees);
+		scheduler->parallelFor(0, subtrees.size(), 1, [&](long long begin, long long end, int) {
+			for (long long s = begin; s < end; ++s)
+				build(subtrees[s].items, subtrees[s].n, subtrees[s].node, subtrees[s].depth);
+		});
+	}
+	else build(items.data(), m_nNode, 0, 0);
+	m_nodeOf.assign(m_size, -1);
+	for (int i = 0; i < m_nNode; ++i) m_nodeOf[m_nodes[i].value] = i;
+	update();
+}
+
+void KDMap::insertPhoton(int node, const Photon &photon, const long long *phi)
+{
+	const Node &cur = m_nodes[node];
+	double dx = cur.P[0] - photon.P[0], dy = cur.P[1] - photon.P[1], dz = cur.P[2] - photon.P[2];
+	if (dx * dx + dy * dy + dz * dz < cur.radius2)
+		if (photon.object == cur.object && !m_data[cur.value].frozen())
+			accumulate(cur.value, phi);
+
+	int split = cur.split;
+	double delta = cur.P[split] - photon.P[split];
+	int near = 2 * node + 1, far = 2 * node + 2;
+	if (delta <= 0) swap(near, far);
+	if (near < m_nNode) insertPhoton(near, photon, phi);
+	if (far < m_nNode && delta * delta < m_nodes[far].maxRadius2 + EPSILON)
+		insertPhoton(far, photon, phi);
+}
+
+void KDMap::insertPacket(int node, const Photon *const *packet, const long long (*phi)[3], const int *active, int n, int *scratch, FluxCache &cache)
+{
+	const Node &cur = m_nodes[node];
+	int split = cur.split, left = 2 * node + 1, right = 2 * node + 2;
+	bool hasLeft = left < m_nNode, hasRight = right < m_nNode;
+	double leftRadius2 = hasLeft ? m_nodes[left].maxRadius2 + EPSILON : 0,
+		   rightRadius2 = hasRight ? m_nodes[right].maxRadius2 + EPSILON : 0;
+
+	// 与逐个写入的剪枝条件相同：近侧子树总要访问，远侧子树仅当分割面在最大半径之内时访问
+	int *leftActive = scratch, *rightActive = scratch + n, nLeft = 0, nRight = 0;
+	for (int j = 0; j < n; ++j)
 	{
-		another = node->left;
-		insertPhoton(node->right, photon);
+		int i = active[j];
+		const Photon &photon = *packet[i];
+		double dx = cur.P[0] - photon.P[0], dy = cur.P[1] - photon.P[1], dz = cur.P[2] - photon.P[2];
+		if (dx * dx + dy * dy + dz * dz < cur.radius2)
+			if (photon.object == cur.object && !m_data[cur.value].frozen())
+				accumulate(cache, cur.value, phi[i]);
+
+		double delta = cur.P[split] - photon.P[split];
+		if (hasLeft && (delta > 0 || delta * delta < leftRadius2)) leftActive[nLeft++] = i;
+		if (hasRight && (delta <= 0 || delta * delta < rightRadius2)) rightActive[nRight++] = i;
 	}
-	if ((another) &&
-		(m_data[pos].P[split] - photon.P[split]) * (m_data[pos].P[split] - photon.P[split]) < m_data[another->value].maxRadius2 + EPSILON)
-		insertPhoton(another, photon);
+	if (nLeft) insertPacket(left, packet, phi, leftActive, nLeft, scratch + 2 * n, cache);
+	if (nRight) insertPacket(right, packet, phi, rightActive, nRight, scratch + 2 * n, cache);
+}
+
+void KDMap::insertPacket(const Photon *const *packet, const long long (*phi)[3], int n, FluxCache &cache)
+{
+	// 每层至多占用2 * PACKET个工作区，树高不超过32
+	int active[PACKET], scratch[2 * PACKET * 32];
+	for (int j = 0; j < n; ++j) active[j] = j;
+	insertPacket(0, packet, phi, active, n, scratch, cache);
+}
+
+bool KDMap::outOfBox(const Vec3 &P) const
+{
+	return m_nNode == 0 || HitPointMap::outOfBox(P, m_nodes[0].maxRadius2);
 }
 
 void KDMap::insertPhoton(const Photon &photon)
 {
-	insertPhoton(m_root, photon);
+	if (outOfBox(photon.P)) return;
+	long long phi[3];
+	toFixed(photon.color, phi);
+	insertPhoton(0, photon, phi);
 }
 
-void KDMap::update(Node *node)
+bool KDMap::visible(int node, const Photon &photon) const
 {
-	if (node->left) update(node->left);
-	if (node->right) update(node->right);
-	m_data[node->value].maxRadius2 = m_data[node->value].radius2;
-	if (node->left && m_data[node->left->value].maxRadius2 > m_data[node->value].maxRadius2)
-		m_data[node->value].maxRadius2 = m_data[node->left->value].maxRadius2;
+	const Node &cur = m_nodes[node];
+	double dx = cur.P[0] - photon.P[0], dy = cur.P[1] - photon.P[1], dz = cur.P[2] - photon.P[2];
+	if (photon.object == cur.object && dx * dx + dy * dy + dz * dz < cur.radius2 && !m_data[cur.value].frozen()) return true;
 
-	if (node->right && m_data[node->right->value].maxRadius2 > m_data[node->value].maxRadius2)
-		m_data[node->value].maxRadius2 = m_data[node->right->value].maxRadius2;
+	int split = cur.split;
+	double delta = cur.P[split] - photon.P[split];
+	int near = 2 * node + 1, far = 2 * node + 2;
+	if (delta <= 0) swap(near, far);
+	if (near < m_nNode && visible(near, photon)) return true;
+	return far < m_nNode && delta * delta < m_nodes[far].maxRadius2 + EPSILON && visible(far, photon);
 }
 
+bool KDMap::visible(const Photon &photon) const
+{
+	return !outOfBox(photon.P) && visible(0, photon);
+}
+
+bool KDMap::refresh(int node)
+{
+	Node &cur = m_nodes[node];
+	double old = cur.maxRadius2;
+	cur.maxRadius2 = cur.radius2;
+	int left = 2 * node + 1, right = 2 * node + 2;
+	if (left < m_nNode && m_nodes[left].maxRadius2 > cur.maxRadius2) cur.maxRadius2 = m_nodes[left].maxRadius2;
+	if (right < m_nNode && m_nodes[right].maxRadius2 > cur.maxRadius2) cur.maxRadius2 = m_nodes[right].maxRadius2;
+	return cur.maxRadius2 != old;
+}
+
+// 同步各碰撞点的半径，并自底向上（广度优先顺序的逆序）重新计算子树的最大半径
 void KDMap::update()
 {
-	update(m_root);
+	for (int i = m_nNode - 1; i >= 0; --i)
+	{
+		m_nodes[i].radius2 = m_data[m_nodes[i].value].radius2;
+		refresh(i);
+	}
+}
+
+void KDMap::update(const vector<int> &dirty, Scheduler *scheduler)
+{
+	// 按层分组：第d层的结点编号位于[2^d - 1, 2^(d + 1) - 1)
+	vector<vector<int>> levels;
+	auto level = [](int node) { int d = 0; while ((2 << d) - 1 <= node) ++d; return d; };
+	for (int i : dirty)
+	{
+		int node = m_nodeOf[i];
+		if (node < 0) continue;
+		m_nodes[node].radius2 = m_data[i].radius2;
+		int d = level(node);
+		if (d >= (int)levels.size()) levels.resize(d + 1);
+		levels[d].push_back(node);
+	}
+
+	// 自底向上逐层处理：同一层的结点互不影响，可以并行；最大半径变化了的结点才把父结点加入上一层
+	vector<char> changed;
+	for (int d = int(levels.size()) - 1; d >= 0; --d)
+	{
+		vector<int> &nodes = levels[d];
+		if (nodes.empty()) continue;
+		sort(nodes.begin(), nodes.end());
+		nodes.erase(unique(nodes.begin(), nodes.end()), nodes.end());
+		changed.assign(nodes.size(), 0);
+		auto work = [&](long long begin, long long end, int) {
+			for (long long j = begin; j < end; ++j) changed[j] = refresh(nodes[j]);
+		};
+		if (scheduler && nodes.size() > 4096) scheduler->parallelFor(0, nodes.size(), 1024, work);
+		else work(0, nodes.size(), 0);
+		if (d == 0) break;
+		for (size_t j = 0; j < nodes.size(); ++j)
+			if (changed[j]) levels[d - 1].push_back((nodes[j] - 1) / 2);
+	}
+	assert(consistent());
+}
+
+bool KDMap::consistent() const
+{
+	for (int i = m_nNode - 1; i >= 0; --i)
+	{
+		const Node &cur = m_nodes[i];
+		double maxRadius2 = cur.radius2;
+		int left = 2 * i + 1, right = 2 * i + 2;
+		if (left < m_nNode) maxRadius2 = max(maxRadius2, m_nodes[left].maxRadius2);
+		if (right < m_nNode) maxRadius2 = max(maxRadius2, m_nodes[right].maxRadius2);
+		if (cur.radius2 != m_data[cur.value].radius2 || cur.maxRadius2 != maxRadius2) return false;
+	}
+	return true;
+}
+
+// 被冻结的碰撞点仍留在树中会拖慢遍历，超过一半时只以未冻结的碰撞点重新建树
+void KDMap::updateBox(Scheduler *scheduler)
+{
+	HitPointMap::updateBox();
+	int nFrozen = 0;
+	for (int i = 0; i < m_nNode; ++i) if (m_data[m_nodes[i].value].frozen()) ++nFrozen;
+	if (nFrozen * 2 > m_nNode) build(scheduler);
 }
 
 KDMap::~KDMap()
 {
-	delete[] m_root;
-	delete[] m_index;
-	delete[] m_memory;
-}
\ No newline at end of file
+	MappedMemory::deallocate(m_memory, m_memorySize);
+}
+///////////////////////////////////////////////////////////////////////////////////
+// PhotonMap
+
+void PhotonMap::build(vector<Node> &nodes)
+{
+	m_nodes.swap(nodes);
+	nodes.clear();
+	build(0, m_nodes.size());
+}
+
+void PhotonMap::build(int l, int r)
+{
+	if (r - l <= 1)
+	{
+		if (r > l) m_nodes[l].split = 0;
+		return;
+	}
+	// 沿包围盒最长的维度划分
+	Vec3 min = m_nodes[l].P, max = m_nodes[l].P;
+	for (int i = l + 1; i < r; ++i) for (int k = 0; k < 3; ++k)
+	{
+		if (m_nodes[i].P[k] < min[k]) min[k] = m_nodes[i].P[k];
+		if (m_nodes[i].P[k] > max[k]) max[k] = m_nodes[i].P[k];
+	}
+	int split = 0;
+	for (int k = 1; k < 3; ++k) if (max[k] - min[k] > max[split] - min[split]) split = k;
+
+	int mid = (l + r) >> 1;
+	nth_element(m_nodes.begin() + l, m_nodes.begin() + mid, m_nodes.begin() + r,
+		[split](const Node &a, const Node &b) { return a.P[split] < b.P[split]; });
+	m_nodes[mid].split = split;
+	build(l, mid);
+	build(mid + 1, r);
+}
+
+void PhotonMap::gather(int l, int r, const Vec3 &P, const Object *object, double radius2, Color &phi) const
+{
+	if (r <= l) return;
+	int mid = (l + r) >> 1;
+	const Node &node = m_nodes[mid];
+	if (node.object == object && dot(node.P - P, node.P - P) < radius2) phi += node.color;
+
+	double delta = P[node.split] - node.P[node.split];
+	if (delta < 0)
+	{
+		gather(l, mid, P, object, radius2, phi);
+		if (delta * delta < radius2) gather(mid + 1, r, P, object, radius2, phi);
+	}
+	else
+	{
+		gather(mid + 1, r, P, object, radius2, phi);
+		if (delta * delta < radius2) gather(l, mid, P, object, radius2, phi);
+	}
+}
+
+Color PhotonMap::gather(const Vec3 &P, const Object *object, double radius2) const
+{
+	Color phi(0, 0, 0);
+	gather(0, m_nodes.size(), P, object, radius2, phi);
+	return phi;
+}
@@ -1,6 +1,11 @@
 #pragma once
-// 光子类Photon，KD树碰撞点图类KDMap
+// 光子类Photon，光通量累加器FluxCounter，碰撞点图基类HitPointMap，KD树碰撞点图类KDMap，KD树光子图类PhotonMap
 #include "../Object.h"
+#include "Scheduler.h"
+#include "SharedState.h"
+#include <atomic>
+#include <vector>
+#include <cstdint>
 
 /**
 光子类Photon，用于实现光子映射，其在空间中的密度分布决定了光照分布
@@ -16,39 +21,187 @@ public:
 };
 
 /**
-碰撞点图类KDMap，用于保存碰撞点的数据结构，
-每发射一个光子p，就在碰撞点图中查询：“p在哪些碰撞点的半径之内？”对查询得到的所有碰撞点累计该光子携带的能量
-KDMap的实现，有部分参考了http://www.cnblogs.com/eyeszjwang/articles/2429382.html中的伪代码，并结合实验情景加以修改
+光通量累加器FluxCounter，光子发射时多线程并发地向其中累加光通量，每轮结束后再合并到HitPoint中。
+光通量以定点整数存储：整数加法满足结合律，累加结果与线程数、累加顺序无关，与单线程完全一致。
+累加器与碰撞点分开紧凑存放，避免多线程写入体积较大的HitPoint造成伪共享
 */
-class KDMap
+struct FluxCounter
 {
+	static const double SCALE;	// 定点数的放大倍数
+	std::atomic<long long> phi[3];
+	std::atomic<int> nNew;
+};
+
+// 点P在包围盒[boxMin, boxMax]内的63位Morton码（每维21位），按其排序即得到空间上连续的顺序
+uint64_t mortonCode(const Vec3 &P, const double *boxMin, const double *boxMax);
+
+/**
+光通量缓存FluxCache，批量写入光子时每个线程一份，按碰撞点编号直接映射。
+按空间顺序排好的光子接连落入同一批碰撞点，它们的光通量先在缓存中合并，
+被挤出或批次结束时才一次性原子地累加到FluxCounter，大幅减少对共享累加器的竞争
+*/
+struct FluxCache
+{
+	static const int SIZE = 1024;	// 2的幂
+	int pos[SIZE];			// 缓存行对应的碰撞点编号，-1为空
+	long long phi[SIZE][3];
+	int nNew[SIZE];
+	FluxCache() { for (int i = 0; i < SIZE; i++) pos[i] = -1; }
+};
+
+/**
+碰撞点图的基类HitPointMap，回答“光子p落在哪些碰撞点的半径之内？”，对查询得到的所有碰撞点累计该光子携带的能量。
+碰撞点数组、光通量累加器与包围盒由基类管理，派生类只需实现空间索引（KD树、哈希网格等），渲染时可任选一种
+*/
+class HitPointMap
+{
+protected:
 	static const int K = 3;
-	struct Node
+	int m_size;			// 碰撞点数目
+	HitPoint *m_data;
+	FluxCounter *m_flux;	// 与m_data一一对应的光通量累加器
+	double m_boxMin[K], m_boxMax[K];	// 未冻结碰撞点的包围盒，用于快速排除远离碰撞点的光子
+
+	// 光子能量的定点表示
+	static void toFixed(const Color &color, long long *phi);
+	// 向第pos个碰撞点累加nNew个光子的光通量，线程安全
+	void accumulate(int pos, const long long *phi, int nNew = 1) {
+		FluxCounter &flux = m_flux[pos];
+		flux.nNew.fetch_add(nNew, std::memory_order_relaxed);
+		for (int c = 0; c < 3; c++) flux.phi[c].fetch_add(phi[c], std::memory_order_relaxed);
+	}
+	// 经由缓存向第pos个碰撞点累加光通量；flushCache将缓存中的光通量全部写回累加器
+	void accumulate(FluxCache &cache, int pos, const long long *phi) {
+		int slot = pos & (FluxCache::SIZE - 1);
+		if (cache.pos[slot] != pos)
+		{
+			if (cache.pos[slot] >= 0) accumulate(cache.pos[slot], cache.phi[slot], cache.nNew[slot]);
+			cache.pos[slot] = pos; cache.nNew[slot] = 0;
+			for (int c = 0; c < 3; c++) cache.phi[slot][c] = 0;
+		}
+		cache.nNew[slot]++;
+		for (int c = 0; c < 3; c++) cache.phi[slot][c] += phi[c];
+	}
+	void flushCache(FluxCache &cache);
+	// 光子落在（以maxRadius2扩展的）包围盒之外时不可能被任何碰撞点接收，如裁剪渲染时窗口外的光子
+	bool outOfBox(const Vec3 &P, double maxRadius2) const;
+	virtual bool outOfBox(const Vec3 &P) const = 0;	// 以当前的最大半径扩展包围盒
+	// 批量写入时的一组光子（至多PACKET个，落点在空间上相邻），phi为各光子能量的定点表示
+	static const int PACKET = 32;
+	virtual void insertPacket(const Photon *const *packet, const long long (*phi)[3], int n, FluxCache &cache) = 0;
+
+public:
+	HitPointMap() : m_size(0), m_data(NULL), m_flux(NULL) {}
+	virtual ~HitPointMap();
+
+	HitPoint *data(int &_size) const { _size = m_size; return m_data; }
+	// 建立索引；给定scheduler时由其并行建立
+	void init(int _size, HitPoint *_data, Scheduler *scheduler = NULL) { load(_size, _data); build(scheduler); }
+	virtual void load(int _size, HitPoint *_data);
+	virtual void build(Scheduler *scheduler = NULL) = 0;
+	virtual void insertPhoton(const Photon &photon) = 0;	// 线程安全，光通量暂存于累加器中
+	// 批量写入一批光子，线程安全：剔除包围盒外的光子，其余按落点的Morton码排序，
+	// 相邻的光子组成一组一起遍历索引，光通量经FluxCache合并后再写入累加器
+	void insertPhotons(const std::vector<Photon> &photons);
+	virtual bool visible(const Photon &photon) const = 0;	// 光子是否落入至少一个未冻结碰撞点的半径之内（不累加光通量）
+	// 将累加器中本轮的光通量合并到第[begin, end)个碰撞点中，须在所有光子发射完毕后调用；touched非空时记录收到光子的碰撞点
+	void flush(int begin, int end, std::vector<int> *touched = NULL);
+	virtual void update() = 0;		// 碰撞点的半径缩小之后调用
+	// 只有dirty中的碰撞点半径变化时调用，可由scheduler并行；默认做完整的update
+	virtual void update(const std::vector<int> &, Scheduler *) { update(); }
+	virtual void updateBox(Scheduler *scheduler = NULL);	// 碰撞点被冻结之后调用，按未冻结的碰撞点重新计算包围盒，远离所有未收敛碰撞点的光子不再进入索引
+};
+
+/**
+碰撞点图类KDMap，用KD树索引碰撞点，每个结点记录子树内的最大半径用于剪枝，
+每发射一个光子p，就在碰撞点图中查询：“p在哪些碰撞点的半径之内？”对查询得到的所有碰撞点累计该光子携带的能量
+树为隐式的左平衡树，按广度优先顺序存放：结点i的左右孩子为2i + 1、2i + 2，不需要指针。
+结点内联了碰撞点的位置、半径、所在物体以及子树的最大半径，恰好占一条64字节的缓存行，
+遍历时只在命中碰撞点时才访问HitPoint数组；批量写入时一组光子一起自顶向下遍历，共享结点的访问。各子树互不相交，建树时上层子树交给多个线程并行。
+每轮只有收到光子的碰撞点半径会变，update(dirty)只更新这些结点，并逐层向上（同层并行）传播子树的最大半径；
+树中只含未冻结的碰撞点，被冻结的碰撞点超过一半时重新建树
+*/
+class KDMap : public HitPointMap
+{
+	struct alignas(64) Node
 	{
-		int value;
-		int split;
-		Node *left, *right;
-	} *m_memory;	// 数组实现
+		double P[K];		// 碰撞点的位置
+		double radius2;		// 碰撞点的半径平方
+		double maxRadius2;	// 子树内的最大半径平方
+		const Object *object;	// 碰撞点所在的物体
+		int value;			// 碰撞点在m_data中的下标
+		int split;			// 划分维度
+	};
 
 private:
-	Node *m_root;	// 根节点
-	int m_size;		// 节点数目
-	int *m_index;	// 坐标对应（因为是数组实现）
-	int m_nNode;	
-	HitPoint *m_data;
+	Node *m_nodes;		// 按广度优先顺序存放的m_nNode个结点，按缓存行对齐
+	char *m_memory;		// m_nodes所在的内存（含对齐余量），开启超大图像模式时为映射内存
+	size_t m_memorySize;
+	int m_nNode;		// 树中的结点数，即建树时未冻结的碰撞点数
+	std::vector<int, MappedAllocator<int>> m_nodeOf;	// 各碰撞点对应的结点，不在树中为-1
 
-	void medianPartition(int l, int r, int dim, int k); //getMedian
-	Node* build(int l, int r, double *min, double *max);//递归建树
-	void insertPhoton(Node *node, const Photon &photon);//递归加入光子
-	void update(Node *node);
+	struct Item	// 建树时的紧凑记录，划分时连续移动，避免反复随机访问HitPoint数组
+	{
+		double P[K];
+		int index;
+	};
+	static int leftSize(int n);	// n个结点的左平衡树中左子树的结点数
+	struct Subtree	// 留给调度器并行建立的子树
+	{
+		Item *items;
+		int n, node, depth;
+	};
+	// 以items[0, n)中的碰撞点建立以node为根的子树；给定subtrees时只划分上面几层，其下的子树存入subtrees
+	void build(Item *items, int n, int node, int depth, std::vector<Subtree> *subtrees = NULL);
+	void insertPhoton(int node, const Photon &photon, const long long *phi);//递归加入光子
+	// 一组光子一起遍历子树：active为组内仍需访问该子树的光子，scratch为下层的工作区
+	void insertPacket(int node, const Photon *const *packet, const long long (*phi)[3], const int *active, int n, int *scratch, FluxCache &cache);
+	bool visible(int node, const Photon &photon) const;//递归查询光子是否可见
+	bool outOfBox(const Vec3 &P) const;//光子是否落在包围盒之外
+	void insertPacket(const Photon *const *packet, const long long (*phi)[3], int n, FluxCache &cache);
+	bool refresh(int node);	// 重新计算结点的最大半径，返回是否变化
+	bool consistent() const;	// 各结点的半径与最大半径是否与完整的update()结果一致，用于调试时检查增量更新
 
 public:
+	KDMap() : m_nodes(NULL), m_memory(NULL), m_memorySize(0), m_nNode(0) {}
 	~KDMap();
 	
-	HitPoint *data(int &_size) const { _size = m_size; return m_data; }
-	void init(int _size, HitPoint *_data) { load(_size, _data); build(); }
 	void load(int _size, HitPoint *_data); 
-	void build(); 
+	void build(Scheduler *scheduler = NULL);
 	void insertPhoton(const Photon &photon);
+ 	bool visible(const Photon &photon) const;
 	void update();
-}; 
\ No newline at end of file
+	void update(const std::vector<int> &dirty, Scheduler *scheduler);
+	void updateBox(Scheduler *scheduler = NULL);
+}; 
+/**
+光子图类PhotonMap，以光子落点为结点的KD树，用于概率渐进式光子映射（PPPM）：
+每轮迭代各自建立一张只读的光子图，再在各碰撞点处以本轮的全局半径收集光子，各轮之间不共享任何可变状态。
+树以隐式方式存放：区间[l, r)的中点即为子树的根，左右子树分别为[l, mid)、[mid + 1, r)
+*/
+class PhotonMap
+{
+public:
+	struct Node
+	{
+		Vec3 P;			// 光子落点
+		Color color;	// 光子能量
+		const Object *object;	// 光子落在的物体
+		int split;		// 划分维度
+		Node() {}
+		Node(const Photon &photon) : P(photon.P), color(photon.color), object(photon.object), split(0) {}
+	};
+
+private:
+	std::vector<Node> m_nodes;
+
+	void build(int l, int r);
+	void gather(int l, int r, const Vec3 &P, const Object *object, double radius2, Color &phi) const;
+
+public:
+	// 以nodes中的落点建立光子图，nodes被取走
+	void build(std::vector<Node> &nodes);
+	int size() const { return int(m_nodes.size()); }
+	// 收集与P位于同一物体、距离平方小于radius2的所有光子的能量之和
+	Color gather(const Vec3 &P, const Object *object, double radius2) const;
+};